@@ -0,0 +1,14 @@
+#-------------------------------------------------
+#
+# Builds the calibration tool and the pipeline benchmark together, so the
+# benchmark is compiled against the current sources
+#
+#-------------------------------------------------
+
+TEMPLATE = subdirs
+
+SUBDIRS += setup \
+    benchmark
+
+setup.file = KilobotArenaSetup.pro
+benchmark.subdir = benchmark
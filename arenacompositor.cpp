@@ -0,0 +1,404 @@
+#include "arenacompositor.h"
+#include <QSemaphore>
+
+// OpenCV includes
+#include <opencv2/imgproc.hpp>
+
+/*!
+ * \brief The cameraWorker class
+ * Captures frames from one camera and remaps them into its region of the arena. There are two remapped buffers so
+ * the next frame can be captured while the assembler blends the current one.
+ */
+class cameraWorker : public QThread
+{
+public:
+    VideoCapture cap;
+    cameraRemap remapTables;
+
+    // the size the remap tables were built for, the capture size requested is only a hint
+    Size frameSize;
+    QString error;
+
+    // the double buffered output, and the time each was captured
+    Mat raw;
+    Mat warped[2];
+    qint64 captureTime[2] = {0, 0};
+
+    // buffers free for the worker to fill, and buffers filled for the assembler to blend
+    QSemaphore freeSlots;
+    QSemaphore filledSlots;
+
+    QAtomicInt * stopping = NULL;
+    QElapsedTimer * clock = NULL;
+    QAtomicInt failed;
+
+private:
+    void run() {
+
+        int slot = 0;
+
+        while (!stopping->load()) {
+
+            if (!freeSlots.tryAcquire(1, 100)) {
+                continue;
+            }
+
+            if (!cap.read(raw)) {
+                // let the assembler see the failure rather than waiting forever
+                error = "A source stopped delivering frames";
+                failed.store(1);
+                filledSlots.release();
+                return;
+            }
+
+            // stamped once the frame has arrived, so waiting for the camera is not counted as latency
+            captureTime[slot] = clock->nsecsElapsed();
+
+            if (raw.size() != frameSize) {
+                error = QString("A source delivers %1x%2 frames, the calibration is for %3x%4")
+                        .arg(raw.cols).arg(raw.rows).arg(frameSize.width).arg(frameSize.height);
+                failed.store(1);
+                filledSlots.release();
+                return;
+            }
+
+            // the remap reuses the preallocated buffer as it is always the same size and type
+            remap(raw, warped[slot], remapTables.map1, remapTables.map2, INTER_LINEAR, BORDER_CONSTANT);
+
+            filledSlots.release();
+            slot = 1 - slot;
+        }
+    }
+};
+
+/*!
+ * \brief addWeightedFixed
+ * Add a 3 channel 8 bit image multiplied by its fixed-point weights to a 16 bit accumulator
+ */
+static void addWeightedFixed(const Mat & src, const Mat & weights, Mat acc)
+{
+    for (int y = 0; y < src.rows; ++y) {
+        const uchar * s = src.ptr<uchar>(y);
+        const ushort * w = weights.ptr<ushort>(y);
+        ushort * a = acc.ptr<ushort>(y);
+        for (int x = 0; x < src.cols; ++x) {
+            ushort wx = w[x];
+            a[3*x] += wx * s[3*x];
+            a[3*x+1] += wx * s[3*x+1];
+            a[3*x+2] += wx * s[3*x+2];
+        }
+    }
+}
+
+ArenaCompositor::ArenaCompositor(QObject *parent) : QThread(parent)
+{
+}
+
+ArenaCompositor::~ArenaCompositor()
+{
+    this->stop();
+    this->closeSources();
+}
+
+bool ArenaCompositor::loadCalibration(QString fileName)
+{
+    if (this->isRunning()) {
+        this->error = "Compositor already running";
+        return false;
+    }
+
+    // the workers and remap tables of the previous calibration may point into the mapping about to be closed, so
+    // they go first, and stay gone if the new calibration can't be loaded
+    this->closeSources();
+    this->remaps.clear();
+    this->weights.clear();
+    this->geometry = ArenaGeometry();
+
+    // binary calibrations are mapped, and their remap tables and weights used in place
+    // the checksum would read every page of the file, so on this live path only the header and table are checked
+    if (this->calibrationFile.open(fileName, false)) {
+        if (!this->calibrationFile.readGeometry(this->geometry)) {
+            this->error = "Calibration is missing or incomplete";
+            this->geometry = ArenaGeometry();
+            return false;
+        }
+        if (this->calibrationFile.readRemaps(int(this->geometry.cameraCount()), this->remaps, this->weights)) {
+            return true;
+        }
+        this->remaps.clear();
+        this->weights.clear();
+    } else if (this->calibrationFile.isCalibrationFile()) {
+        this->error = this->calibrationFile.lastError();
+        return false;
+    } else {
+        // OpenCV throws rather than failing when the file is not XML or YAML
+        try {
+            FileStorage fs(fileName.toStdString(), FileStorage::READ);
+            if (!fs.isOpened()) {
+                this->error = this->calibrationFile.lastError();
+                return false;
+            }
+            if (!this->geometry.read(fs)) {
+                this->error = "Calibration is missing or incomplete (calibrations must be re-saved to include the arena geometry)";
+                this->geometry = ArenaGeometry();
+                return false;
+            }
+        } catch (cv::Exception &) {
+            this->error = fileName + " is not a calibration file";
+            this->geometry = ArenaGeometry();
+            return false;
+        }
+    }
+
+    // build the remap tables and blend weights for each camera
+    this->remaps.clear();
+    for (uint i = 0; i < this->geometry.cameraCount(); ++i) {
+        this->remaps.push_back(this->geometry.buildRemap(i));
+    }
+    this->weights = this->geometry.buildBlendWeights(this->remaps);
+
+    return true;
+}
+
+bool ArenaCompositor::openSources(QStringList sources)
+{
+    if (this->isRunning()) {
+        this->error = "Compositor already running";
+        return false;
+    }
+
+    if (this->remaps.empty()) {
+        this->error = "No calibration loaded";
+        return false;
+    }
+
+    if (sources.size() != int(this->remaps.size())) {
+        this->error = QString::number(this->remaps.size()) + " sources are required by the calibration";
+        return false;
+    }
+
+    this->closeSources();
+
+    for (int i = 0; i < sources.size(); ++i) {
+
+        cameraWorker * worker = new cameraWorker;
+        this->workers.push_back(worker);
+
+        bool isDevice = false;
+        int device = sources[i].toInt(&isDevice);
+        if (isDevice) {
+            worker->cap.open(device);
+            worker->cap.set(CV_CAP_PROP_FRAME_WIDTH, this->geometry.cameraSize.width);
+            worker->cap.set(CV_CAP_PROP_FRAME_HEIGHT, this->geometry.cameraSize.height);
+        } else {
+            worker->cap.open(sources[i].toStdString());
+        }
+
+        if (!worker->cap.isOpened()) {
+            this->error = "Could not open source " + sources[i];
+            this->closeSources();
+            return false;
+        }
+
+        worker->remapTables = this->remaps[i];
+        worker->frameSize = this->geometry.cameraSize;
+        worker->stopping = &this->stopping;
+        worker->clock = &this->clock;
+        worker->warped[0].create(this->remaps[i].arenaRoi.size(), CV_8UC3);
+        worker->warped[1].create(this->remaps[i].arenaRoi.size(), CV_8UC3);
+    }
+
+    return true;
+}
+
+void ArenaCompositor::closeSources()
+{
+    for (uint i = 0; i < this->workers.size(); ++i) {
+        this->workers[i]->cap.release();
+        delete this->workers[i];
+    }
+    this->workers.clear();
+}
+
+bool ArenaCompositor::startCompositing()
+{
+    if (this->isRunning()) {
+        this->error = "Compositor already running";
+        return false;
+    }
+    if (this->workers.empty()) {
+        this->error = "No sources open";
+        return false;
+    }
+
+    // everything is reset before the threads start, so a stop() made while they start up is not lost
+    this->queued.clear();
+    this->freeBuffers.clear();
+    for (int i = 0; i < this->queueLength + 1; ++i) {
+        this->freeBuffers.push_back(Mat(this->geometry.arenaSize, CV_8UC3));
+    }
+    this->dropped.store(0);
+
+    this->stopping.store(0);
+    this->clock.start();
+    for (uint i = 0; i < this->workers.size(); ++i) {
+        this->workers[i]->freeSlots.release(2 - this->workers[i]->freeSlots.available());
+        this->workers[i]->filledSlots.acquire(this->workers[i]->filledSlots.available());
+        this->workers[i]->failed.store(0);
+        this->workers[i]->error.clear();
+    }
+
+    this->start();
+    for (uint i = 0; i < this->workers.size(); ++i) {
+        this->workers[i]->start();
+    }
+    return true;
+}
+
+void ArenaCompositor::stop()
+{
+    this->stopping.store(1);
+    for (uint i = 0; i < this->workers.size(); ++i) {
+        this->workers[i]->wait();
+    }
+    this->wait();
+    this->frameQueued.wakeAll();
+}
+
+bool ArenaCompositor::nextFrame(arenaFrame & frame, int timeoutMs)
+{
+    QMutexLocker locker(&this->queueMutex);
+
+    while (this->queued.isEmpty()) {
+        if (!this->isRunning() || !this->frameQueued.wait(&this->queueMutex, timeoutMs)) {
+            return false;
+        }
+    }
+
+    arenaFrame queuedFrame = this->queued.dequeue();
+    queuedFrame.image.copyTo(frame.image);
+    frame.index = queuedFrame.index;
+    frame.captureTime = queuedFrame.captureTime;
+    frame.readyTime = queuedFrame.readyTime;
+
+    // recycle the buffer
+    this->freeBuffers.push_back(queuedFrame.image);
+
+    return true;
+}
+
+double ArenaCompositor::fps()
+{
+    QMutexLocker locker(&this->statsMutex);
+    return this->currentFps;
+}
+
+double ArenaCompositor::latencyMs()
+{
+    QMutexLocker locker(&this->statsMutex);
+    return this->currentLatencyMs;
+}
+
+void ArenaCompositor::run()
+{
+    // preallocate everything used per frame, the queue and workers are reset by startCompositing
+    Mat acc(this->geometry.arenaSize, CV_16UC3);
+
+    int slot = 0;
+    qint64 frameIndex = 0;
+    qint64 windowStart = this->clock.nsecsElapsed();
+    int windowFrames = 0;
+    qint64 windowLatency = 0;
+
+    while (!this->stopping.load()) {
+
+        // wait for every camera to deliver this frame
+        for (uint i = 0; i < this->workers.size() && !this->stopping.load(); ++i) {
+            while (!this->workers[i]->filledSlots.tryAcquire(1, 100)) {
+                if (this->stopping.load()) {
+                    break;
+                }
+            }
+        }
+        if (this->stopping.load()) {
+            break;
+        }
+
+        bool failed = false;
+        qint64 captureTime = this->workers[0]->captureTime[slot];
+        for (uint i = 0; i < this->workers.size(); ++i) {
+            if (this->workers[i]->failed.load()) {
+                this->error = this->workers[i]->error;
+                failed = true;
+            }
+            captureTime = min(captureTime, this->workers[i]->captureTime[slot]);
+        }
+        if (failed) {
+            this->stopping.store(1);
+            break;
+        }
+
+        // blend the cameras
+        acc.setTo(Scalar::all(0));
+        for (uint i = 0; i < this->workers.size(); ++i) {
+            if (!this->weights[i].empty()) {
+                addWeightedFixed(this->workers[i]->warped[slot], this->weights[i], acc(this->remaps[i].arenaRoi));
+            }
+            this->workers[i]->freeSlots.release();
+        }
+        slot = 1 - slot;
+
+        // get a free output buffer, dropping the oldest frame if the consumer has fallen behind
+        Mat buffer;
+        {
+            QMutexLocker locker(&this->queueMutex);
+            if (!this->freeBuffers.empty()) {
+                buffer = this->freeBuffers.back();
+                this->freeBuffers.pop_back();
+            } else {
+                buffer = this->queued.dequeue().image;
+                this->dropped.ref();
+            }
+        }
+
+        acc.convertTo(buffer, CV_8U, 1.0/256.0);
+
+        arenaFrame frame;
+        frame.image = buffer;
+        frame.index = frameIndex++;
+        frame.captureTime = captureTime;
+        frame.readyTime = this->clock.nsecsElapsed();
+
+        {
+            QMutexLocker locker(&this->queueMutex);
+            if (this->queued.size() >= this->queueLength) {
+                this->freeBuffers.push_back(this->queued.dequeue().image);
+                this->dropped.ref();
+            }
+            this->queued.enqueue(frame);
+        }
+        this->frameQueued.wakeAll();
+
+        // update the stats every second
+        ++windowFrames;
+        windowLatency += frame.readyTime - frame.captureTime;
+        if (frame.readyTime - windowStart >= 1000000000LL) {
+            double fps = double(windowFrames) * 1e9 / double(frame.readyTime - windowStart);
+            double latency = double(windowLatency) / double(windowFrames) / 1e6;
+            {
+                QMutexLocker locker(&this->statsMutex);
+                this->currentFps = fps;
+                this->currentLatencyMs = latency;
+            }
+            emit statsUpdated(fps, latency);
+            windowStart = frame.readyTime;
+            windowFrames = 0;
+            windowLatency = 0;
+        }
+    }
+
+    for (uint i = 0; i < this->workers.size(); ++i) {
+        this->workers[i]->wait();
+    }
+    this->frameQueued.wakeAll();
+}
@@ -0,0 +1,176 @@
+#ifndef ARENACOMPOSITOR_H
+#define ARENACOMPOSITOR_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+#include <opencv2/videoio.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+// Qt base include
+#include <QThread>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QQueue>
+#include <QElapsedTimer>
+#include <QAtomicInt>
+#include <QAtomicInteger>
+#include <QStringList>
+
+// Project includes
+#include "arenawarp.h"
+#include "calibrationfile.h"
+
+class cameraWorker;
+
+/*!
+ * \brief The arenaFrame struct
+ * A composited arena frame and its timing, times are in nanoseconds from the start of compositing
+ */
+struct arenaFrame
+{
+    Mat image;
+    qint64 index = 0;
+    qint64 captureTime = 0;
+    qint64 readyTime = 0;
+};
+
+/*!
+ * \brief The ArenaCompositor class
+ *
+ * Applies a saved calibration to live camera streams (or recorded files), producing squared arena frames at the
+ * camera frame rate. Each camera has a worker thread that captures and remaps its frames straight into its region
+ * of the arena using the precomputed remap tables, while this thread feather blends the cameras together using
+ * precomputed fixed-point weights and pushes the result into a bounded queue. All the buffers are allocated up front
+ * so nothing is allocated per frame. If the consumer falls behind the oldest queued frame is dropped, keeping the
+ * latency bounded.
+ */
+class ArenaCompositor : public QThread
+{
+    Q_OBJECT
+public:
+    explicit ArenaCompositor(QObject *parent = 0);
+    ~ArenaCompositor();
+
+    /*!
+     * \brief loadCalibration
+     * Load a calibration written by CalibrateArena, either binary or XML, building the remap tables and blend
+     * weights if the file doesn't include them
+     */
+    bool loadCalibration(QString fileName);
+
+    /*!
+     * \brief openSources
+     * Open a source for each camera, in calibration order. Numeric sources are camera device indices, anything
+     * else is opened as a video file.
+     */
+    bool openSources(QStringList sources);
+
+    /*!
+     * \brief startCompositing
+     * Reset the queue and start the assembler and camera threads, use this rather than start(). Returns false if no
+     * sources are open.
+     */
+    bool startCompositing();
+
+    /*!
+     * \brief stop
+     * Stop compositing and wait for all the threads to finish
+     */
+    void stop();
+
+    /*!
+     * \brief nextFrame
+     * Take the oldest queued frame, waiting up to timeoutMs for one to arrive. The image is copied into the
+     * given frame, reusing its buffer if it is already the arena size.
+     */
+    bool nextFrame(arenaFrame & frame, int timeoutMs = 1000);
+
+    /*!
+     * \brief setQueueLength
+     * Set the number of frames that can be queued before the oldest is dropped, must be called before starting
+     */
+    void setQueueLength(int length) { this->queueLength = length; }
+
+    /*!
+     * \brief fps
+     * The sustained frame rate over the last second
+     */
+    double fps();
+
+    /*!
+     * \brief latencyMs
+     * The mean capture to ready latency over the last second
+     */
+    double latencyMs();
+
+    /*!
+     * \brief droppedFrames
+     * The number of frames dropped because the queue was full
+     */
+    qint64 droppedFrames() { return this->dropped.load(); }
+
+    /*!
+     * \brief getArenaSize
+     * The size of the composited frames
+     */
+    Size getArenaSize() { return this->geometry.arenaSize; }
+
+    QString lastError() { return this->error; }
+
+signals:
+    /*!
+     * \brief statsUpdated
+     * Emitted once a second with the sustained fps and mean latency in ms
+     */
+    void statsUpdated(double fps, double latencyMs);
+
+private:
+    /*!
+     * \brief run
+     * The assembler loop, blending each set of camera frames into an arena frame
+     */
+    void run();
+
+    void closeSources();
+
+    ArenaGeometry geometry;
+    vector < cameraRemap > remaps;
+
+    /*!
+     * \brief calibrationFile
+     * The mapped binary calibration, when one is loaded the remaps and weights point into it
+     */
+    CalibrationFile calibrationFile;
+
+    /*!
+     * \brief weights
+     * Fixed-point (x256) feather weights for each camera over its arena roi, summing to at most 256
+     */
+    vector < Mat > weights;
+
+    vector < cameraWorker * > workers;
+
+    QAtomicInt stopping;
+    QElapsedTimer clock;
+
+    // the bounded output queue and its preallocated buffers
+    int queueLength = 3;
+    QMutex queueMutex;
+    QWaitCondition frameQueued;
+    QQueue < arenaFrame > queued;
+    vector < Mat > freeBuffers;
+    QAtomicInteger < qint64 > dropped;
+
+    // stats for the last complete second
+    QMutex statsMutex;
+    double currentFps = 0.0;
+    double currentLatencyMs = 0.0;
+
+    QString error;
+};
+
+#endif // ARENACOMPOSITOR_H
@@ -0,0 +1,433 @@
+#include "arenawarp.h"
+
+// OpenCV includes
+#include <opencv2/stitching.hpp>
+
+// Qt includes
+#include <QFuture>
+#include <QThreadPool>
+#include <QVector>
+#include <QtConcurrent>
+
+// Project includes
+#include "stagetimer.h"
+
+/*!
+ * \brief warpLowCamera
+ * Shrink a camera image to around the given megapixels and warp it into the low resolution output, for estimating
+ * the exposure gains. Run concurrently across the cameras.
+ */
+static warpedCamera warpLowCamera(Mat image, Mat toLow, Size lowSize, double megapix, int camera)
+{
+    ScopedStageTimer timer("warp low camera", "warp");
+    timer.addArg("camera", camera);
+
+    double imageScale = megapixScale(megapix, image.size());
+    Mat lowImage = image;
+    if (imageScale < 1.0) {
+        cv::resize(image, lowImage, Size(), imageScale, imageScale, INTER_AREA);
+    }
+    return warpCamera(lowImage, toLow, lowSize, imageScale);
+}
+
+/*!
+ * \brief warpBlendCamera
+ * Warp a camera image into the output and convert it to the 16 bit image the blender takes, applying the exposure
+ * gain. H must already include any resize of the image. Run concurrently across the cameras.
+ */
+static warpedCamera warpBlendCamera(Mat image, Mat H, Size outputSize, double gain, int camera)
+{
+    ScopedStageTimer timer("warp camera", "warp");
+    timer.addArg("camera", camera);
+
+    warpedCamera warped = warpCamera(image, H, outputSize);
+    if (!warped.image.empty()) {
+        UMat image_s;
+        warped.image.convertTo(image_s, CV_16S, gain);
+        warped.image = image_s;
+    }
+    return warped;
+}
+
+Rect warpedRoi(Size srcSize, const Mat & H, Size outputSize)
+{
+    vector < Point2f > srcCorners;
+    srcCorners.push_back(Point2f(0,0));
+    srcCorners.push_back(Point2f(srcSize.width,0));
+    srcCorners.push_back(Point2f(0,srcSize.height));
+    srcCorners.push_back(Point2f(srcSize.width,srcSize.height));
+
+    vector < Point2f > dstCorners;
+    perspectiveTransform(srcCorners, dstCorners, H);
+
+    Rect roi = boundingRect(dstCorners);
+    return roi & Rect(Point(0,0), outputSize);
+}
+
+double megapixScale(double megapix, Size imageSize)
+{
+    if (megapix <= 0.0 || imageSize.area() == 0) {
+        return 1.0;
+    }
+    return min(1.0, sqrt(megapix * 1e6 / imageSize.area()));
+}
+
+Mat scaleMatrix(double scale)
+{
+    Mat_<double> S = Mat::eye(3, 3, CV_64F);
+    S(0,0) = scale;
+    S(1,1) = scale;
+    S(0,2) = 0.5 * scale - 0.5;
+    S(1,2) = 0.5 * scale - 0.5;
+    return S;
+}
+
+warpedCamera warpCamera(InputArray image, const Mat & Hcamera, Size outputSize, double imageScale)
+{
+    warpedCamera warped;
+
+    // take a resized image back to raw camera pixels
+    Mat H = Hcamera;
+    if (imageScale != 1.0) {
+        H = Hcamera * scaleMatrix(1.0 / imageScale);
+    }
+
+    Rect roi = warpedRoi(image.size(), H, outputSize);
+    warped.corner = roi.tl();
+
+    if (roi.area() == 0) {
+        return warped;
+    }
+
+    // shift the homography so the warp only generates the covered region
+    Mat_<double> shift = Mat::eye(3, 3, CV_64F);
+    shift(0,2) = -roi.x;
+    shift(1,2) = -roi.y;
+    Mat Hroi = shift * H;
+
+    warpPerspective(image, warped.image, Hroi, roi.size(), INTER_LINEAR, BORDER_REFLECT);
+
+    UMat mask(image.size(), CV_8U, Scalar::all(255));
+    warpPerspective(mask, warped.mask, Hroi, roi.size(), INTER_NEAREST, BORDER_CONSTANT);
+
+    return warped;
+}
+
+vector < double > estimateGains(const vector < Mat > & images, const vector < Mat > & homographies, Size outputSize, double megapix)
+{
+    ScopedStageTimer timer("exposure estimation", "warp");
+
+    // shrink both the cameras and the output to around the requested size
+    double outputScale = megapixScale(megapix, outputSize);
+    Size lowSize(max(1, cvRound(outputSize.width * outputScale)), max(1, cvRound(outputSize.height * outputScale)));
+    Mat toLow = scaleMatrix(outputScale);
+
+    // the cameras are shrunk and warped concurrently
+    QVector < QFuture < warpedCamera > > warpJobs;
+    for (uint i = 0; i < images.size(); ++i) {
+        warpJobs.push_back(QtConcurrent::run(warpLowCamera, images[i], Mat(toLow * homographies[i]), lowSize, megapix, int(i)));
+    }
+
+    vector<Point> corners(images.size());
+    vector<UMat> images_warped(images.size());
+    vector<UMat> masks_warped(images.size());
+    for (uint i = 0; i < images.size(); ++i) {
+        warpedCamera warped = warpJobs[i].result();
+        corners[i] = warped.corner;
+        images_warped[i] = warped.image;
+        masks_warped[i] = warped.mask;
+    }
+
+    Ptr<detail::GainCompensator> compensator = makePtr<detail::GainCompensator>();
+    compensator->feed(corners, images_warped, masks_warped);
+    return compensator->gains();
+}
+
+Mat composeCameras(const vector < Mat > & images, const vector < Mat > & homographies, const vector < double > & gains, Size outputSize,
+                   double imageScale, const QAtomicInt * cancel)
+{
+    // feather the images together
+    Ptr<detail::Blender> blender;
+    blender = detail::Blender::createDefault(detail::Blender::FEATHER, false);
+    blender->prepare(Rect(Point(0,0), outputSize));
+
+    // the cameras are warped, masked and converted concurrently, but the blender is not thread safe so they are
+    // fed to it in camera order as each becomes ready. Only as many cameras as there are pool threads are in flight
+    // at once, each queued as an earlier one is fed, so at most that many warped cameras are held however many
+    // cameras there are.
+    Mat fromImage = scaleMatrix(1.0 / imageScale);
+    uint inFlight = uint(max(1, QThreadPool::globalInstance()->maxThreadCount()));
+    QVector < QFuture < warpedCamera > > warpJobs(int(images.size()));
+    uint queued = 0;
+
+    for (uint i = 0; i < images.size(); ++i) {
+        for (; queued < images.size() && queued < i + inFlight; ++queued) {
+            double gain = queued < gains.size() ? gains[queued] : 1.0;
+            warpJobs[queued] = QtConcurrent::run(warpBlendCamera, images[queued], Mat(homographies[queued] * fromImage),
+                                                 outputSize, gain, int(queued));
+        }
+        if (cancel && cancel->load()) {
+            return Mat();
+        }
+        warpedCamera warped = warpJobs[i].result();
+        warpJobs[i] = QFuture < warpedCamera > ();
+        if (warped.image.empty()) {
+            continue;
+        }
+        ScopedStageTimer timer("feed camera", "warp");
+        timer.addArg("camera", i);
+        blender->feed(warped.image, warped.mask, warped.corner);
+    }
+
+    Mat result, result_mask;
+    blender->blend(result, result_mask);
+
+    // convert (not sure what this does, but is necessary apparantly)
+    result.convertTo(result, (result.type() / 8) * 8);
+
+    return result;
+}
+
+bool ArenaGeometry::isValid() const
+{
+    return this->cameraCount() > 0 && (this->isPlanar() || this->Ks.size() == this->Rs.size()) && this->corners.size() == 4
+            && this->gridRows > 0 && this->gridCols > 0 && uint(this->gridRows * this->gridCols) == this->cameraCount()
+            && this->panoramaRoi.area() > 0 && this->stitchedSize.area() > 0 && this->arenaSize.area() > 0;
+}
+
+void ArenaGeometry::setMetricSize(Size2d millimetres, double mmPerPixel)
+{
+    this->arenaMillimetres = millimetres;
+    this->mmPerPixel = mmPerPixel;
+    this->arenaSize = Size(max(1, cvRound(millimetres.width / mmPerPixel)), max(1, cvRound(millimetres.height / mmPerPixel)));
+}
+
+Mat ArenaGeometry::squaring() const
+{
+    Point2f inputQuad[4];
+    Point2f outputQuad[4];
+
+    for (int i = 0; i < 4; ++i) {
+        inputQuad[i] = this->corners[i];
+    }
+
+    outputQuad[0] = Point2f(0,0);
+    outputQuad[1] = Point2f(this->arenaSize.width,0);
+    outputQuad[2] = Point2f(0,this->arenaSize.height);
+    outputQuad[3] = Point2f(this->arenaSize.width,this->arenaSize.height);
+
+    return getPerspectiveTransform(inputQuad,outputQuad);
+}
+
+Mat ArenaGeometry::cameraToStitched(int camera) const
+{
+    Mat toPlane;
+    if (this->isPlanar()) {
+        this->planarHs[camera].convertTo(toPlane, CV_64F);
+    } else {
+        Mat K, R;
+        this->Ks[camera].convertTo(K, CV_64F);
+        this->Rs[camera].convertTo(R, CV_64F);
+
+        // the PlaneWarper projects a camera pixel p to warpScale * (R * K^-1 * p), dehomogenised
+        Mat_<double> plane = Mat::eye(3, 3, CV_64F);
+        plane(0,0) = this->warpScale;
+        plane(1,1) = this->warpScale;
+        toPlane = plane * R * K.inv();
+    }
+
+    // the panorama starts at the top left of its roi on the plane and is then resized to the stitched size
+    // (using the pixel centre convention of cv::resize)
+    double sx = double(this->stitchedSize.width) / double(this->panoramaRoi.width);
+    double sy = double(this->stitchedSize.height) / double(this->panoramaRoi.height);
+    Mat_<double> toStitched = Mat::eye(3, 3, CV_64F);
+    toStitched(0,0) = sx;
+    toStitched(1,1) = sy;
+    toStitched(0,2) = 0.5 * sx - 0.5 - sx * this->panoramaRoi.x;
+    toStitched(1,2) = 0.5 * sy - 0.5 - sy * this->panoramaRoi.y;
+
+    Mat H = toStitched * toPlane;
+    return H / H.at<double>(2,2);
+}
+
+Mat ArenaGeometry::cameraToArena(int camera) const
+{
+    Mat H = this->squaring() * this->cameraToStitched(camera);
+    return H / H.at<double>(2,2);
+}
+
+Rect ArenaGeometry::arenaRoi(int camera) const
+{
+    return warpedRoi(this->cameraSize, this->cameraToArena(camera), this->arenaSize);
+}
+
+cameraRemap ArenaGeometry::buildRemap(int camera) const
+{
+    cameraRemap remapTables;
+    remapTables.arenaRoi = this->arenaRoi(camera);
+
+    if (remapTables.arenaRoi.area() == 0) {
+        return remapTables;
+    }
+
+    // the lookup goes backwards, from the arena pixel to the camera pixel
+    Mat_<double> Hinv = this->cameraToArena(camera).inv();
+
+    Mat mapX(remapTables.arenaRoi.size(), CV_32F);
+    Mat mapY(remapTables.arenaRoi.size(), CV_32F);
+
+    for (int y = 0; y < mapX.rows; ++y) {
+        float * xRow = mapX.ptr<float>(y);
+        float * yRow = mapY.ptr<float>(y);
+        double ay = y + remapTables.arenaRoi.y;
+        for (int x = 0; x < mapX.cols; ++x) {
+            double ax = x + remapTables.arenaRoi.x;
+            double w = Hinv(2,0) * ax + Hinv(2,1) * ay + Hinv(2,2);
+            w = w != 0.0 ? 1.0 / w : 0.0;
+            xRow[x] = float((Hinv(0,0) * ax + Hinv(0,1) * ay + Hinv(0,2)) * w);
+            yRow[x] = float((Hinv(1,0) * ax + Hinv(1,1) * ay + Hinv(1,2)) * w);
+        }
+    }
+
+    // fixed point maps are both smaller and faster to remap with
+    convertMaps(mapX, mapY, remapTables.map1, remapTables.map2, CV_16SC2);
+
+    return remapTables;
+}
+
+/*!
+ * \brief remappedWeight
+ * A camera's feather weights over a region of the arena within its roi, remapping only that part of its tables
+ */
+static Mat remappedWeight(const Mat & border, const cameraRemap & remapTables, Rect region)
+{
+    Rect local = region - remapTables.arenaRoi.tl();
+    Mat weight;
+    remap(border, weight, remapTables.map1(local), remapTables.map2.empty() ? Mat() : remapTables.map2(local),
+          INTER_LINEAR, BORDER_CONSTANT, Scalar(0));
+    return weight;
+}
+
+vector < Mat > ArenaGeometry::buildBlendWeights(const vector < cameraRemap > & remaps) const
+{
+    // the feather weight of each camera pixel is its distance to the image border, so cameras fade out smoothly
+    // towards the edges of the overlaps
+    Mat border(this->cameraSize, CV_32F);
+    for (int y = 0; y < border.rows; ++y) {
+        float * row = border.ptr<float>(y);
+        for (int x = 0; x < border.cols; ++x) {
+            row[x] = float(min(min(x + 1, border.cols - x), min(y + 1, border.rows - y)));
+        }
+    }
+
+    // each camera is normalised by the total over its own roi, adding in only the overlapping parts of the cameras
+    // that overlap it, so nothing the size of the whole arena is needed however large it is
+    vector < Mat > weights(remaps.size());
+    for (uint i = 0; i < remaps.size(); ++i) {
+        Rect roi = remaps[i].arenaRoi;
+        if (roi.area() == 0) {
+            continue;
+        }
+        Mat own = remappedWeight(border, remaps[i], roi);
+        Mat total = own.clone();
+        for (uint j = 0; j < remaps.size(); ++j) {
+            Rect overlap = roi & remaps[j].arenaRoi;
+            if (j == i || overlap.area() == 0) {
+                continue;
+            }
+            Mat totalOverlap = total(overlap - roi.tl());
+            totalOverlap += remappedWeight(border, remaps[j], overlap);
+        }
+
+        // normalise and convert to fixed-point, rounding down so the weights never sum to more than 256 and the
+        // 16 bit accumulator cannot overflow
+        Mat normalised;
+        divide(own, total, normalised, 256.0);
+        normalised -= 0.5;
+        normalised.convertTo(weights[i], CV_16U);
+    }
+
+    return weights;
+}
+
+void ArenaGeometry::write(FileStorage & fs) const
+{
+    fs << "corner1" << this->corners[0];
+    fs << "corner2" << this->corners[1];
+    fs << "corner3" << this->corners[2];
+    fs << "corner4" << this->corners[3];
+
+    fs << "cameras" << int(this->cameraCount());
+    fs << "gridRows" << this->gridRows;
+    fs << "gridCols" << this->gridCols;
+
+    fs << "R" << this->Rs;
+    fs << "K" << this->Ks;
+    if (this->isPlanar()) {
+        fs << "planarH" << this->planarHs;
+    }
+
+    fs << "warpScale" << this->warpScale;
+    fs << "panoramaRoi" << this->panoramaRoi;
+    fs << "stitchedSize" << this->stitchedSize;
+    fs << "cameraSize" << this->cameraSize;
+    fs << "arenaSize" << this->arenaSize;
+    fs << "arenaMillimetres" << this->arenaMillimetres;
+    fs << "mmPerPixel" << this->mmPerPixel;
+
+    vector < Mat > Hs;
+    for (uint i = 0; i < this->cameraCount(); ++i) {
+        Hs.push_back(this->cameraToArena(i));
+    }
+    fs << "H" << Hs;
+}
+
+bool ArenaGeometry::read(FileStorage & fs)
+{
+    if (!fs.isOpened()) {
+        return false;
+    }
+
+    // files saved before the geometry was recorded only have the corners and camera matrices
+    if (fs["panoramaRoi"].empty() || fs["stitchedSize"].empty() || fs["cameraSize"].empty()) {
+        return false;
+    }
+
+    this->corners.resize(4);
+    fs["corner1"] >> this->corners[0];
+    fs["corner2"] >> this->corners[1];
+    fs["corner3"] >> this->corners[2];
+    fs["corner4"] >> this->corners[3];
+
+    fs["R"] >> this->Rs;
+    fs["K"] >> this->Ks;
+    this->planarHs.clear();
+    if (!fs["planarH"].empty()) {
+        fs["planarH"] >> this->planarHs;
+    }
+
+    // files saved before the grid was recorded always came from a 2x2 grid
+    if (fs["gridRows"].empty() || fs["gridCols"].empty()) {
+        this->gridRows = 2;
+        this->gridCols = 2;
+    } else {
+        fs["gridRows"] >> this->gridRows;
+        fs["gridCols"] >> this->gridCols;
+    }
+
+    fs["warpScale"] >> this->warpScale;
+    fs["panoramaRoi"] >> this->panoramaRoi;
+    fs["stitchedSize"] >> this->stitchedSize;
+    fs["cameraSize"] >> this->cameraSize;
+    fs["arenaSize"] >> this->arenaSize;
+
+    // files saved before the scale was recorded have no physical size
+    this->arenaMillimetres = Size2d();
+    this->mmPerPixel = 0.0;
+    if (!fs["mmPerPixel"].empty()) {
+        fs["arenaMillimetres"] >> this->arenaMillimetres;
+        fs["mmPerPixel"] >> this->mmPerPixel;
+    }
+
+    return this->isValid();
+}
@@ -0,0 +1,253 @@
+#ifndef ARENAWARP_H
+#define ARENAWARP_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+// Qt base include
+#include <QAtomicInt>
+
+/*!
+ * \brief The cameraRemap struct
+ * Precomputed lookup tables for one camera, in the fixed-point format produced by cv::convertMaps. Remapping a raw
+ * camera frame with these gives the part of the squared arena image seen by that camera.
+ */
+struct cameraRemap
+{
+    /*!
+     * \brief arenaRoi
+     * The region of the squared arena image covered by the camera, the maps are this size
+     */
+    Rect arenaRoi;
+    /*!
+     * \brief map1
+     * Integer source co-ordinates (CV_16SC2)
+     */
+    Mat map1;
+    /*!
+     * \brief map2
+     * Interpolation table indices (CV_16UC1)
+     */
+    Mat map2;
+};
+
+/*!
+ * \brief The warpedCamera struct
+ * A camera image warped into an output image, covering only the region of the output that the camera sees
+ */
+struct warpedCamera
+{
+    /*!
+     * \brief corner
+     * The top left of the covered region in the output image
+     */
+    Point corner;
+    UMat image;
+    UMat mask;
+};
+
+/*!
+ * \brief warpedRoi
+ * The region of an output image covered by an image of the given size under the homography H, clipped to the output
+ */
+Rect warpedRoi(Size srcSize, const Mat & H, Size outputSize);
+
+/*!
+ * \brief megapixScale
+ * The scale that resizes an image of the given size to the given megapixels, capped at 1 (<= 0 megapixels gives 1)
+ */
+double megapixScale(double megapix, Size imageSize);
+
+/*!
+ * \brief warpCamera
+ * Warp a camera image and its mask into the region of the output image it covers, using a single resampling. H is
+ * in raw camera pixels, imageScale gives the scale of the image if it has been resized from the raw camera size.
+ */
+warpedCamera warpCamera(InputArray image, const Mat & H, Size outputSize, double imageScale = 1.0);
+
+/*!
+ * \brief scaleMatrix
+ * The homography of a cv::resize by the given scale (using its pixel centre convention)
+ */
+Mat scaleMatrix(double scale);
+
+/*!
+ * \brief estimateGains
+ * Estimate the exposure gains of the cameras from low resolution warps into the output (of around the given
+ * megapixels), as the gains do not depend on the resolution and this keeps the memory use small
+ */
+vector < double > estimateGains(const vector < Mat > & images, const vector < Mat > & homographies, Size outputSize, double megapix);
+
+/*!
+ * \brief composeCameras
+ * Warp the cameras into the output and blend them, applying the exposure gains. The cameras are warped concurrently,
+ * with no more in flight than there are pool threads so the warped cameras held at once stay bounded, and fed to
+ * the blender in order as each is ready. imageScale is as for warpCamera. If cancel is given and becomes
+ * non-zero, composing stops before the next camera and an empty image is returned.
+ */
+Mat composeCameras(const vector < Mat > & images, const vector < Mat > & homographies, const vector < double > & gains, Size outputSize,
+                   double imageScale = 1.0, const QAtomicInt * cancel = NULL);
+
+/*!
+ * \brief The ArenaGeometry class
+ *
+ * Everything needed to take a pixel in a raw camera image to the squared arena image. The stitcher models the
+ * cameras as rotating about a common centre and projects them onto a plane, the plane image is then resized to the
+ * stitched image and finally squared using the arena corners. As every stage is a homography, this class composes
+ * them into a single camera to arena homography per camera, so the arena image can be generated with a single
+ * resampling of each camera image.
+ *
+ * The planar stitcher instead maps each camera straight onto the floor plane, as seen by a reference camera, with a
+ * homography. When these are present (planarHs) they take the place of the rotating camera model, and Ks and Rs
+ * are empty.
+ */
+class ArenaGeometry
+{
+public:
+    // camera parameters from the stitcher
+    vector < Mat > Ks;
+    vector < Mat > Rs;
+
+    /*!
+     * \brief planarHs
+     * The homographies from raw camera pixels to the floor plane, in the raw pixels of the reference camera, for
+     * geometry from the planar stitcher
+     */
+    vector < Mat > planarHs;
+
+    /*!
+     * \brief gridRows, gridCols
+     * The layout of the cameras over the arena, the cameras are numbered along the rows
+     */
+    int gridRows = 2;
+    int gridCols = 2;
+
+    /*!
+     * \brief warpScale
+     * The scale of the PlaneWarper used by the stitcher
+     */
+    float warpScale = 3000.0f;
+
+    /*!
+     * \brief panoramaRoi
+     * The region of the warped plane covered by the stitched panorama
+     */
+    Rect panoramaRoi;
+
+    /*!
+     * \brief stitchedSize
+     * The size the panorama is resized to, the arena corners are in these co-ordinates
+     */
+    Size stitchedSize;
+
+    /*!
+     * \brief cameraSize
+     * The size of the raw camera images
+     */
+    Size cameraSize;
+
+    /*!
+     * \brief corners
+     * The arena corners in stitched image co-ordinates, ordered top-left, top-right, bottom-left, bottom-right
+     */
+    vector < Point2f > corners;
+
+    /*!
+     * \brief arenaSize
+     * The size of the squared arena image, set from the physical size of the arena by setMetricSize
+     */
+    Size arenaSize = Size(2000,2000);
+
+    /*!
+     * \brief arenaMillimetres
+     * The physical size of the arena between the corner markers, zero if not recorded
+     */
+    Size2d arenaMillimetres;
+
+    /*!
+     * \brief mmPerPixel
+     * The scale of the squared arena image, zero if not recorded
+     */
+    double mmPerPixel = 0.0;
+
+    /*!
+     * \brief setMetricSize
+     * Set the physical size of the arena and the scale of the squared arena image, which sets its size
+     */
+    void setMetricSize(Size2d millimetres, double mmPerPixel);
+
+    /*!
+     * \brief isValid
+     * True if the geometry is complete enough to map cameras to the arena
+     */
+    bool isValid() const;
+
+    /*!
+     * \brief isPlanar
+     * True if the geometry came from the planar stitcher
+     */
+    bool isPlanar() const { return !this->planarHs.empty(); }
+
+    /*!
+     * \brief cameraCount
+     * The number of cameras
+     */
+    uint cameraCount() const { return uint(this->isPlanar() ? this->planarHs.size() : this->Ks.size()); }
+
+    /*!
+     * \brief squaring
+     * The homography from stitched image co-ordinates to squared arena co-ordinates
+     */
+    Mat squaring() const;
+
+    /*!
+     * \brief cameraToStitched
+     * The homography from raw camera pixels to stitched image pixels
+     */
+    Mat cameraToStitched(int camera) const;
+
+    /*!
+     * \brief cameraToArena
+     * The homography from raw camera pixels to squared arena pixels
+     */
+    Mat cameraToArena(int camera) const;
+
+    /*!
+     * \brief arenaRoi
+     * The region of the squared arena image covered by a camera, clipped to the arena image
+     */
+    Rect arenaRoi(int camera) const;
+
+    /*!
+     * \brief buildRemap
+     * Build the fixed-point remap tables taking a raw camera image to its region of the squared arena image
+     */
+    cameraRemap buildRemap(int camera) const;
+
+    /*!
+     * \brief buildBlendWeights
+     * Build fixed-point (x256) feather weights for each camera over its arena roi from its remap tables, summing
+     * to at most 256 at every arena pixel
+     */
+    vector < Mat > buildBlendWeights(const vector < cameraRemap > & remaps) const;
+
+    /*!
+     * \brief write
+     * Write the geometry to an OpenCV FileStorage
+     */
+    void write(FileStorage & fs) const;
+
+    /*!
+     * \brief read
+     * Read the geometry from an OpenCV FileStorage written by write(), returns false if anything is missing
+     */
+    bool read(FileStorage & fs);
+};
+
+#endif // ARENAWARP_H
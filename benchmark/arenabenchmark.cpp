@@ -0,0 +1,223 @@
+// QT includes
+#include <QCoreApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QTextStream>
+
+// Project includes
+#include "calibratearena.h"
+#include "stagetimer.h"
+
+/*!
+ * \brief makeArena
+ * Generate a textured planar arena with a 4:3 aspect ratio, with texture at several scales so the feature finder
+ * has something to work with at every resolution, and green corner markers
+ */
+static Mat makeArena(int width, RNG & rng)
+{
+    int height = width * 3 / 4;
+
+    // coarse blotches plus fine noise
+    Mat coarse(height / 64 + 1, width / 64 + 1, CV_8UC3);
+    rng.fill(coarse, RNG::UNIFORM, Scalar::all(40), Scalar::all(200));
+    Mat arena;
+    cv::resize(coarse, arena, Size(width, height), 0, 0, INTER_CUBIC);
+
+    Mat fine(height, width, CV_8UC3);
+    rng.fill(fine, RNG::NORMAL, Scalar::all(0), Scalar::all(12));
+    arena += fine;
+
+    // scattered shapes give strong, repeatable blobs and corners
+    int shapes = width * height / 4000;
+    for (int i = 0; i < shapes; ++i) {
+        Point centre(rng.uniform(0, width), rng.uniform(0, height));
+        Scalar colour(rng.uniform(0, 255), rng.uniform(0, 255), rng.uniform(0, 255));
+        int size = rng.uniform(width / 400 + 2, width / 100 + 4);
+        if (i % 2) {
+            circle(arena, centre, size, colour, -1);
+        } else {
+            rectangle(arena, Rect(centre, Size(size, size * 2 / 3 + 1)), colour, -1);
+        }
+    }
+
+    // the corner markers
+    int inset = width / 40;
+    int radius = width / 200 + 2;
+    circle(arena, Point(inset, inset), radius, Scalar(0,255,0), -1);
+    circle(arena, Point(width - inset, inset), radius, Scalar(0,255,0), -1);
+    circle(arena, Point(inset, height - inset), radius, Scalar(0,255,0), -1);
+    circle(arena, Point(width - inset, height - inset), radius, Scalar(0,255,0), -1);
+
+    return arena;
+}
+
+/*!
+ * \brief gridSpan
+ * The width of the arena in camera views, when neighbouring views overlap by a third
+ */
+static float gridSpan(int cameras)
+{
+    return float(cameras) - float(cameras - 1) / 3.0f;
+}
+
+/*!
+ * \brief makeCameraViews
+ * Generate overlapping camera views of the arena in a grid, each with a small random perspective tilt
+ */
+static vector<Mat> makeCameraViews(const Mat & arena, Size cameraSize, int gridRows, int gridCols, RNG & rng)
+{
+    vector<Mat> views;
+
+    // neighbouring cameras overlap by a third of their view, so for a 2x2 grid each sees 60% of the arena
+    float viewW = arena.cols / gridSpan(gridCols);
+    float viewH = arena.rows / gridSpan(gridRows);
+    float jitter = 0.02f * viewW / 0.6f;
+
+    for (int row = 0; row < gridRows; ++row) {
+        for (int col = 0; col < gridCols; ++col) {
+            Point2f cameraQuad[4];
+            Point2f arenaQuad[4];
+
+            cameraQuad[0] = Point2f(0,0);
+            cameraQuad[1] = Point2f(cameraSize.width,0);
+            cameraQuad[2] = Point2f(0,cameraSize.height);
+            cameraQuad[3] = Point2f(cameraSize.width,cameraSize.height);
+
+            float x0 = gridCols > 1 ? col * (arena.cols - viewW) / (gridCols - 1) : 0.0f;
+            float y0 = gridRows > 1 ? row * (arena.rows - viewH) / (gridRows - 1) : 0.0f;
+            arenaQuad[0] = Point2f(x0, y0);
+            arenaQuad[1] = Point2f(x0 + viewW, y0);
+            arenaQuad[2] = Point2f(x0, y0 + viewH);
+            arenaQuad[3] = Point2f(x0 + viewW, y0 + viewH);
+            for (int i = 0; i < 4; ++i) {
+                arenaQuad[i] += Point2f(rng.uniform(-jitter, jitter), rng.uniform(-jitter, jitter));
+            }
+
+            Mat H = getPerspectiveTransform(cameraQuad, arenaQuad);
+            Mat view;
+            warpPerspective(arena, view, H, cameraSize, INTER_LINEAR | WARP_INVERSE_MAP, BORDER_REFLECT);
+            views.push_back(view);
+        }
+    }
+
+    return views;
+}
+
+int main(int argc, char *argv[])
+{
+    QCoreApplication a(argc, argv);
+
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Benchmark the calibration pipeline on synthetic camera grids");
+    parser.addHelpOption();
+    QCommandLineOption sizesOption(QStringList() << "sizes", "Camera resolutions to benchmark",
+                                   "WxH,...", "1024x768,2048x1536,4096x3072");
+    QCommandLineOption runsOption(QStringList() << "runs", "Repeats at each resolution", "count", "3");
+    QCommandLineOption gridOption(QStringList() << "grid", "Camera grid as rows x columns", "RxC", "2x2");
+    QCommandLineOption seedOption(QStringList() << "seed", "Random seed for the synthetic arena", "seed", "1");
+    QCommandLineOption workMegapixOption(QStringList() << "work-megapix",
+                                         "Feature detection size in megapixels, 0 for full size", "value", "0.6");
+    QCommandLineOption composeMegapixOption(QStringList() << "compose-megapix",
+                                            "Compose size in megapixels, 0 for full size", "value", "0");
+    parser.addOption(sizesOption);
+    parser.addOption(workMegapixOption);
+    parser.addOption(composeMegapixOption);
+    parser.addOption(gridOption);
+    parser.addOption(runsOption);
+    parser.addOption(seedOption);
+    parser.process(a);
+
+    QStringList sizes = parser.value(sizesOption).split(',');
+
+    QTextStream out(stdout);
+    QTextStream err(stderr);
+
+    bool ok = false;
+    int runs = parser.value(runsOption).toInt(&ok);
+    if (!ok || runs < 1) {
+        err << "Invalid run count " << parser.value(runsOption) << endl;
+        return 1;
+    }
+
+    // 0 megapixels means full size
+    double workMegapix = parser.value(workMegapixOption).toDouble(&ok);
+    if (!ok || workMegapix < 0.0) {
+        err << "Invalid work megapixels " << parser.value(workMegapixOption) << endl;
+        return 1;
+    }
+    double composeMegapix = parser.value(composeMegapixOption).toDouble(&ok);
+    if (!ok || composeMegapix < 0.0) {
+        err << "Invalid compose megapixels " << parser.value(composeMegapixOption) << endl;
+        return 1;
+    }
+
+    QStringList grid = parser.value(gridOption).split('x');
+    if (grid.size() != 2 || grid[0].toInt() < 1 || grid[1].toInt() < 1) {
+        err << "Invalid camera grid " << parser.value(gridOption) << endl;
+        return 1;
+    }
+    int gridRows = grid[0].toInt();
+    int gridCols = grid[1].toInt();
+
+    // machine readable results, one line per stage per run
+    out << "width,height,run,stage,seconds" << endl;
+
+    for (int s = 0; s < sizes.size(); ++s) {
+
+        QStringList dims = sizes[s].split('x');
+        if (dims.size() != 2 || dims[0].toInt() <= 0 || dims[1].toInt() <= 0) {
+            err << "Invalid size " << sizes[s] << endl;
+            return 1;
+        }
+        Size cameraSize(dims[0].toInt(), dims[1].toInt());
+
+        RNG rng(parser.value(seedOption).toULongLong());
+        Mat arena = makeArena(int(cameraSize.width * gridSpan(gridCols)), rng);
+        vector<Mat> views = makeCameraViews(arena, cameraSize, gridRows, gridCols, rng);
+        arena.release();
+
+        for (int run = 0; run < runs; ++run) {
+
+            // a new calibrater each run, so the feature cache doesn't hide the detection cost
+            CalibrateArena calibrater;
+            calibrater.setDisplayEnabled(false);
+            calibrater.setCameraGrid(gridRows, gridCols);
+            calibrater.setTraceFile("");
+            calibrater.setWorkMegapix(workMegapix);
+            calibrater.setComposeMegapix(composeMegapix);
+
+            qint64 start = TraceRecorder::instance().now();
+            QElapsedTimer total;
+            total.start();
+
+            calibrater.setCalibrationImages(views);
+            calibrater.extractFeatures();
+            if (!calibrater.hasGoodMatches() || !calibrater.stitchImagesBlocking()) {
+                err << "Pipeline failed at " << sizes[s] << " run " << run << endl;
+                out << cameraSize.width << "," << cameraSize.height << "," << run << ",failed," << endl;
+                continue;
+            }
+
+            // square using a fixed inset of the stitched image, the exact corners don't affect the timing
+            Size stitched = calibrater.getStitchedImage().size();
+            vector<Point2f> corners;
+            corners.push_back(Point2f(0.05f * stitched.width, 0.05f * stitched.height));
+            corners.push_back(Point2f(0.95f * stitched.width, 0.05f * stitched.height));
+            corners.push_back(Point2f(0.05f * stitched.width, 0.95f * stitched.height));
+            corners.push_back(Point2f(0.95f * stitched.width, 0.95f * stitched.height));
+            calibrater.setArenaCorners(corners);
+            calibrater.squareArena();
+
+            double totalSeconds = double(total.nsecsElapsed()) / 1e9;
+
+            QVector < QPair < QString, qint64 > > totals = TraceRecorder::instance().totalsSince(start);
+            for (int i = 0; i < totals.size(); ++i) {
+                out << cameraSize.width << "," << cameraSize.height << "," << run << "," << totals[i].first << ","
+                    << double(totals[i].second) / 1e6 << endl;
+            }
+            out << cameraSize.width << "," << cameraSize.height << "," << run << ",total," << totalSeconds << endl;
+        }
+    }
+
+    return 0;
+}
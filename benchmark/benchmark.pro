@@ -0,0 +1,36 @@
+#-------------------------------------------------
+#
+# Benchmark of the calibration pipeline on synthetic arenas
+#
+#-------------------------------------------------
+
+QT       += core gui concurrent
+
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets
+
+TARGET = KilobotArenaBenchmark
+TEMPLATE = app
+CONFIG += console
+CONFIG -= app_bundle
+
+INCLUDEPATH += ..
+
+SOURCES += arenabenchmark.cpp \
+    ../calibratearena.cpp \
+    ../stitchthread.cpp \
+    ../arenawarp.cpp \
+    ../stagetimer.cpp \
+    ../cornermarkers.cpp \
+    ../calibrationfile.cpp \
+    ../tiledarenawriter.cpp
+
+HEADERS  += ../calibratearena.h \
+    ../stitchthread.h \
+    ../arenawarp.h \
+    ../stagetimer.h \
+    ../cornermarkers.h \
+    ../calibrationfile.h \
+    ../tiledarenawriter.h \
+    ../calibrationsession.h
+
+include(../opencv.pri)
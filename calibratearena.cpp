@@ -1,173 +1,184 @@
 #include "calibratearena.h"
+#include "stitchthread.h"
+#include "stagetimer.h"
+#include "cornermarkers.h"
+#include "calibrationfile.h"
 #include <QImage>
 #include <QDebug>
-#include <QThread>
 #include <QDir>
 #include <QSettings>
 #include <QFileDialog>
+#include <QFileInfo>
+#include <QFuture>
+#include <QtConcurrent>
+#include <QCryptographicHash>
 
+/*!
+ * \brief The arenaExportJob struct
+ * Writes the arena image on the thread pool, holding the session so the images stay valid
+ */
+struct arenaExportJob
+{
+    typedef bool result_type;
+
+    arenaExportJob(TiledArenaWriter * writer, calibrationSessionPtr session, vector<Mat> homographies, vector<double> gains,
+                   Size arenaSize, QString fileName)
+        : writer(writer), session(session), homographies(homographies), gains(gains), arenaSize(arenaSize), fileName(fileName) {}
+
+    bool operator()() const
+    {
+        return this->writer->write(*this->session->images, this->homographies, this->gains, this->arenaSize, this->fileName);
+    }
+
+    TiledArenaWriter * writer;
+    calibrationSessionPtr session;
+    vector<Mat> homographies;
+    vector<double> gains;
+    Size arenaSize;
+    QString fileName;
+};
 
 /*!
- * \brief The stitchThread class
- * As the stitching can hang, we run it in a seperate thread
+ * \brief findCameraFeatures
+ * Run the SURF feature finder on a single camera image, resized by workScale. The finders are not thread safe, so
+ * each call creates its own, allowing the cameras to be processed concurrently.
  */
-class stitchThread : public QThread
+static void findCameraFeatures(Mat image, detail::ImageFeatures * features, int threshold, int index, double workScale)
 {
-public:
-    // the data we need to run the stitcher
-    vector <Mat> cameraCalibrationImages;
-    vector<detail::ImageFeatures> features;
-    vector<detail::MatchesInfo> pairwise_matches;
+    ScopedStageTimer timer("SURF", "features");
 
-    // the stitcher output
-    Mat finalImage;
-
-    // reprojection details to save...
-    vector < Mat > Ks;
-    vector < Mat > Rs;
-
-
-private:
-    /*!
-     * \brief run
-     * The execution method for the thread, performing the stitching process
-     */
-    void run() {
-
-        // Camera estimation
-        detail::HomographyBasedEstimator estimator;
-        vector<detail::CameraParams> cameras;
-        estimator(features, pairwise_matches, cameras);
-
-        for (size_t i = 0; i < cameras.size(); ++i)
-         {
-             Mat R;
-             cameras[i].R.convertTo(R, CV_32F);
-             cameras[i].R = R;
-         }
-
-        // Refine projection
-        Ptr<detail::BundleAdjusterBase> adjuster;
-        adjuster = makePtr<detail::BundleAdjusterReproj>();
-        adjuster->setConfThresh(0.6f);
-        Mat_<uchar> refine_mask = Mat::zeros(3, 3, CV_8U);
-        refine_mask(0,0) = 1;
-        refine_mask(0,1) = 1;
-        refine_mask(0,2) = 1;
-        refine_mask(1,1) = 1;
-        refine_mask(1,2) = 1;
-        adjuster->setRefinementMask(refine_mask);
-        (*adjuster)(features, pairwise_matches, cameras);
-
-        // Find median focal length
-        vector<double> focals;
-        for (size_t i = 0; i < cameras.size(); ++i)
-        {
-            focals.push_back(cameras[i].focal);
-        }
-
-        sort(focals.begin(), focals.end());
-        float warped_image_scale;
-        if (focals.size() % 2 == 1)
-            warped_image_scale = static_cast<float>(focals[focals.size() / 2]);
-        else
-            warped_image_scale = static_cast<float>(focals[focals.size() / 2 - 1] + focals[focals.size() / 2]) * 0.5f;
-
-        vector<Mat> rmats;
-        for (size_t i = 0; i < cameras.size(); ++i)
-            rmats.push_back(cameras[i].R.clone());
-        detail::waveCorrect(rmats, detail::WAVE_CORRECT_HORIZ);
-        for (size_t i = 0; i < cameras.size(); ++i)
-            cameras[i].R = rmats[i];
-
-        vector<UMat> masks(cameraCalibrationImages.size());
-        vector<UMat> masks_warped(cameraCalibrationImages.size());
-        vector<UMat> images_warped(cameraCalibrationImages.size());
-        vector<Point> corners(cameraCalibrationImages.size());
-        vector<Size> sizes(cameraCalibrationImages.size());
-
-        // Prepare images masks
-        for (int i = 0; i < cameraCalibrationImages.size(); ++i)
-        {
-          masks[i].create(cameraCalibrationImages[i].size(), CV_8U);
-          masks[i].setTo(Scalar::all(255));
-        }
-
-        Ptr<WarperCreator> warper_creator;
-        warper_creator = makePtr<cv::PlaneWarper>();
-        Ptr<detail::RotationWarper> warper = warper_creator->create(3000.0f);
-
-
-        for (int i = 0; i < cameraCalibrationImages.size(); ++i) {
-            Mat_<float> K;
-            cameras[i].K().convertTo(K, CV_32F);
-            corners[i] = warper->warp(cameraCalibrationImages[i], K, cameras[i].R, INTER_LINEAR, BORDER_REFLECT, images_warped[i]);
-            sizes[i] = images_warped[i].size();
-            warper->warp(masks[i], K, cameras[i].R, INTER_NEAREST, BORDER_CONSTANT, masks_warped[i]);
-        }
-
-        // calculate to compensate for exposure
-        Ptr<detail::ExposureCompensator> compensator = detail::ExposureCompensator::createDefault(detail::ExposureCompensator::GAIN);
-        compensator->feed(corners, images_warped, masks_warped);
-
-        // apply compensation
-        for (int i = 0; i < cameraCalibrationImages.size(); ++i) {
-            compensator->apply(i, corners[i], images_warped[i], masks_warped[i]);
-        }
-
-        // feather the images together
-        Ptr<detail::Blender> blender;
-        blender = detail::Blender::createDefault(detail::Blender::FEATHER, false);
-        blender->prepare(corners, sizes);
-        vector <Mat> images_warped_s(images_warped.size());
-        for (int i = 0; i < cameraCalibrationImages.size(); ++i)
-        {
-            images_warped[i].convertTo(images_warped_s[i], CV_16S);
-            blender->feed(images_warped_s[i], masks_warped[i], corners[i]);
-        }
-
-        Mat result, result_mask;
-        blender->blend(result, result_mask);
-
-        // convert (not sure what this does, but is necessary apparantly)
-        result.convertTo(result, (result.type() / 8) * 8);
-
-        cv::resize(result, finalImage,Size(1536,1536));
-
-        this->Ks.clear();
-        this->Rs.clear();
-
-        // send back the necessary transformation Matrices
-        for (uint i = 0; i < cameras.size(); ++i) {
-            this->Ks.push_back(cameras[i].K());
-            this->Rs.push_back(cameras[i].R);
+    // detect at the work resolution, the cameras are rescaled to full resolution after estimation
+    Mat workImage = image;
+    if (workScale < 1.0) {
+        cv::resize(image, workImage, Size(), workScale, workScale, INTER_AREA);
+    }
+
+    Ptr<detail::FeaturesFinder> finder;
+    finder = makePtr<detail::SurfFeaturesFinder>(threshold);
+    (*finder)(workImage, *features);
+    finder->collectGarbage();
+    features->img_idx = index;
+    timer.addArg("camera", index);
+    timer.addArg("keypoints", features->keypoints.size());
+}
+
+/*!
+ * \brief hashImage
+ * Hash the pixel data and geometry of an image, used as the key for the feature cache
+ */
+static QByteArray hashImage(const Mat & image)
+{
+    QCryptographicHash hash(QCryptographicHash::Md5);
+    int geometry[3] = {image.cols, image.rows, image.type()};
+    hash.addData((const char *) geometry, sizeof(geometry));
+    for (int i = 0; i < image.rows; ++i) {
+        hash.addData((const char *) image.ptr(i), int(image.cols * image.elemSize()));
+    }
+    return hash.result();
+}
+
+/*!
+ * \brief gridMatchMask
+ * The pairs of cameras to match, those next to each other in the camera grid. Only neighbours overlap, so this
+ * keeps the matching cost linear in the number of cameras and avoids spurious matches between distant cameras.
+ */
+static Mat gridMatchMask(int gridRows, int gridCols, bool diagonals)
+{
+    int cameras = gridRows * gridCols;
+    Mat mask = Mat::zeros(cameras, cameras, CV_8U);
+
+    for (int i = 0; i < cameras; ++i) {
+        for (int j = 0; j < cameras; ++j) {
+            int rowStep = abs(i / gridCols - j / gridCols);
+            int colStep = abs(i % gridCols - j % gridCols);
+            if (i != j && rowStep <= 1 && colStep <= 1 && (diagonals || rowStep + colStep == 1)) {
+                mask.at<uchar>(i, j) = 1;
+            }
         }
     }
-};
 
+    return mask;
+}
+
+/*!
+ * \brief matchGridFeatures
+ * Match the features of the pairs of cameras in the mask, returning the indices of the largest set of cameras
+ * connected by confident matches
+ */
+static vector<int> matchGridFeatures(const vector<detail::ImageFeatures> & features, const Mat & matchMask, float matcherThreshold, vector<detail::MatchesInfo> & pairwise_matches)
+{
+    detail::BestOf2NearestMatcher matcher(false, matcherThreshold);
+    matcher(features, pairwise_matches, matchMask.getUMat(ACCESS_READ));
+    matcher.collectGarbage();
+
+    // leaveBiggestComponent cuts the features and matches down to the matched images, but only the indices are
+    // needed here. It just counts and subsets the features, so give it empty stand-ins rather than the keypoints
+    vector<detail::ImageFeatures> componentFeatures(features.size());
+    vector<detail::MatchesInfo> componentMatches = pairwise_matches;
+    return detail::leaveBiggestComponent(componentFeatures, componentMatches, 0.5f);
+}
 
 CalibrateArena::CalibrateArena(QPoint smallImageSize, QObject *parent) : QObject(parent)
 {
     this->smallImageSize = smallImageSize;
+    this->resultDisplaySize = Size(smallImageSize.x() * 2, smallImageSize.y() * 2);
+
+    // start with an empty session, so there is always one to refer to
+    CalibrationSession * emptySession = new CalibrationSession;
+    emptySession->images = QSharedPointer < const vector < Mat > > (new vector < Mat >);
+    this->session = calibrationSessionPtr(emptySession);
+
+    this->traceFileName = QDir::temp().filePath("KilobotArenaSetup_trace.json");
+
+    this->rematchTimer.setSingleShot(true);
+    this->rematchTimer.setInterval(50);
+    connect(&this->rematchTimer, SIGNAL(timeout()), this, SLOT(matchFeatures()));
+
+    this->previewTimer.setSingleShot(true);
+    this->previewTimer.setInterval(250);
+    connect(&this->previewTimer, SIGNAL(timeout()), this, SLOT(runPreview()));
+
+    this->arenaExportTimer.setInterval(250);
+    connect(&this->arenaExportTimer, SIGNAL(timeout()), this, SLOT(arenaExportProgress()));
+    connect(&this->arenaExport, SIGNAL(finished()), this, SLOT(arenaExportFinished()));
 }
 
 CalibrateArena::~CalibrateArena()
 {
-    // clean up memory
+    // clean up memory, letting any running stitch finish its current stage and any export its current tiles first
+    this->arenaWriter.requestCancel();
+    this->arenaExport.waitForFinished();
     if (this->thread) {
+        this->thread->requestCancel();
+        this->thread->wait();
         delete this->thread;
     }
+    if (this->previewThread) {
+        this->previewThread->requestCancel();
+        this->previewThread->wait();
+        delete this->previewThread;
+    }
 }
 
-void CalibrateArena::setCalibrationImages(vector<Mat> calImgs)
+void CalibrateArena::setCalibrationImages(const vector<Mat> & calImgs, const vector<qint64> & captureTimes)
 {
-    this->cameraCalibrationImages = calImgs;
+    // start a new session sharing the image data, the features and matches from the previous images go with the
+    // old session once nothing else refers to it
+    CalibrationSession * newSession = new CalibrationSession;
+    newSession->images = QSharedPointer < const vector < Mat > > (new vector < Mat > (calImgs));
+    newSession->captureTimes = captureTimes;
+
+    // hash the images to key the feature cache
+    for (uint i = 0; i < calImgs.size(); ++i) {
+        newSession->imageHashes.push_back(hashImage(calImgs[i]));
+    }
+    this->session = calibrationSessionPtr(newSession);
 
     // create the small images and populate them from the big images
     vector <Mat *> imgsSmall;
-    for (uint i = 0; i < this->cameraCalibrationImages.size(); ++i) {
+    for (uint i = 0; this->displayEnabled && i < calImgs.size(); ++i) {
         imgsSmall.push_back(new Mat);
-        cv::resize(this->cameraCalibrationImages[i], *imgsSmall[i], Size(this->smallImageSize.x(),this->smallImageSize.y()));
+        cv::resize(calImgs[i], *imgsSmall[i], Size(this->smallImageSize.x(),this->smallImageSize.y()));
     }
 
     for (uint i = 0; i < imgsSmall.size(); ++i)
@@ -177,15 +188,7 @@ void CalibrateArena::setCalibrationImages(vector<Mat> calImgs)
         QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
         QPixmap pix = QPixmap::fromImage(qimg);
         // send the pixmap to the respective QLabel
-        if (i == 0) {
-            emit setImage0(pix);
-        } else if (i == 1) {
-            emit setImage1(pix);
-        } else if (i == 2) {
-            emit setImage2(pix);
-        } else if (i == 3) {
-            emit setImage3(pix);
-        }
+        emit setImage(int(i), pix);
     }
 
     // delete the small images
@@ -195,68 +198,289 @@ void CalibrateArena::setCalibrationImages(vector<Mat> calImgs)
 
     emit errorMessage("Images loaded");
 
+    this->schedulePreview();
+
+}
+
+void CalibrateArena::setCameraGrid(int rows, int cols)
+{
+    this->gridRows = qMax(1, rows);
+    this->gridCols = qMax(1, cols);
+    this->schedulePreview();
+}
+
+void CalibrateArena::setWorkMegapix(double val)
+{
+    this->workMegapix = val;
+}
+
+void CalibrateArena::setComposeMegapix(double val)
+{
+    this->composeMegapix = val;
+}
+
+void CalibrateArena::setAdjusterMaxIterations(int val)
+{
+    this->adjusterMaxIterations = val;
+}
+
+void CalibrateArena::setAdjusterMaxSeconds(double val)
+{
+    this->adjusterMaxSeconds = val;
+}
+
+void CalibrateArena::setWarmStart(bool enabled)
+{
+    this->warmStart = enabled;
+}
+
+void CalibrateArena::setStitchEngine(int engine)
+{
+    this->stitchEngine = engine;
+    this->schedulePreview();
 }
 
 void CalibrateArena::setFeatureFinderThreshold(int val)
 {
     this->featureFinderThreshold = val;
+    this->schedulePreview();
 }
 
 void CalibrateArena::setMatcherThreshold(int val)
 {
     this->matcherThreshold = float(val)/100.0f;
+
+    // only the matching depends on this threshold, so if we have features re-match as the value changes
+    if (this->session->features) {
+        this->rematchTimer.start();
+    }
+    this->schedulePreview();
+}
+
+void CalibrateArena::setLivePreview(bool enabled)
+{
+    this->livePreview = enabled;
+    if (enabled) {
+        this->previewTimer.start();
+    } else {
+        this->previewTimer.stop();
+        this->previewPending = false;
+        if (this->previewThread != NULL) {
+            this->previewThread->requestCancel();
+        }
+    }
+}
+
+void CalibrateArena::runPreview()
+{
+    const vector<Mat> & images = *this->session->images;
+    if (!this->livePreview || images.empty() || images.size() != this->cameraCount()) {
+        return;
+    }
+
+    // cancel a running preview, another starts when it stops
+    if (this->previewThread != NULL && this->previewThread->isRunning()) {
+        this->previewThread->requestCancel();
+        this->previewPending = true;
+        return;
+    }
+    this->previewPending = false;
+
+    this->previewStart = TraceRecorder::instance().now();
+
+    // downscale the images once per session, the preview features are found at the preview scale
+    if (!this->previewSession || this->previewSession->imageHashes != this->session->imageHashes) {
+        ScopedStageTimer timer("preview downscale", "preview");
+        vector<Mat> * previewImages = new vector<Mat>(images.size());
+        for (uint i = 0; i < images.size(); ++i) {
+            double previewScale = megapixScale(this->previewMegapix, images[i].size());
+            cv::resize(images[i], (*previewImages)[i], Size(), previewScale, previewScale, INTER_AREA);
+        }
+        CalibrationSession * downscaled = new CalibrationSession;
+        downscaled->images = QSharedPointer < const vector < Mat > > (previewImages);
+        downscaled->imageHashes = this->session->imageHashes;
+        this->previewSession = calibrationSessionPtr(downscaled);
+        this->previewThreshold = -1;
+    }
+
+    const vector<Mat> & previewImages = *this->previewSession->images;
+    for (uint i = 1; i < previewImages.size(); ++i) {
+        if (previewImages[i].size() != previewImages[0].size()) {
+            emit errorMessage("Preview: not all calibration images are the same size");
+            return;
+        }
+    }
+
+    CalibrationSession * preview = new CalibrationSession(*this->previewSession);
+
+    // only the feature finder threshold needs the features found again
+    if (this->previewThreshold != this->featureFinderThreshold || !preview->features) {
+        vector<detail::ImageFeatures> * features = new vector<detail::ImageFeatures>(previewImages.size());
+        QVector < QFuture < void > > finderJobs;
+        for (uint i = 0; i < previewImages.size(); ++i) {
+            finderJobs.push_back(QtConcurrent::run(findCameraFeatures, previewImages[i], &(*features)[i], this->featureFinderThreshold, int(i), 1.0));
+        }
+        for (int i = 0; i < finderJobs.size(); ++i) {
+            finderJobs[i].waitForFinished();
+        }
+        preview->features = QSharedPointer < const vector < detail::ImageFeatures > > (features);
+        this->previewThreshold = this->featureFinderThreshold;
+    }
+
+    vector<detail::MatchesInfo> * matches = new vector<detail::MatchesInfo>;
+    vector<int> indices;
+    {
+        ScopedStageTimer timer("preview matching", "preview");
+        indices = matchGridFeatures(*preview->features, gridMatchMask(this->gridRows, this->gridCols, this->matchDiagonals),
+                                    this->matcherThreshold, *matches);
+    }
+    preview->matches = QSharedPointer < const vector < detail::MatchesInfo > > (matches);
+    preview->goodMatches = indices.size() == previewImages.size();
+    this->previewSession = calibrationSessionPtr(preview);
+
+    if (!this->previewSession->goodMatches) {
+        emit errorMessage("Preview: cannot match all the images, try reducing the feature and/or match thresholds");
+        return;
+    }
+
+    if (this->previewThread == NULL) {
+        this->previewThread = new stitchThread;
+        connect(this->previewThread, SIGNAL(finished()), this, SLOT(previewFinished()));
+    }
+
+    // the preview is composed at the preview resolution straight into an image the size of the display
+    this->previewThread->session = this->previewSession;
+    this->previewThread->composeScale = 1.0;
+    this->previewThread->stitchedMegapix = double(this->smallImageSize.x() * this->smallImageSize.y()) / 1e6;
+    // the preview has its own interactive budget, a poorly matched preview shows what it has rather than waiting
+    this->previewThread->adjusterMaxIterations = min(this->adjusterMaxIterations, this->previewAdjusterMaxIterations);
+    this->previewThread->adjusterMaxSeconds = min(this->adjusterMaxSeconds, this->previewAdjusterMaxSeconds);
+    this->previewThread->engine = this->stitchEngine;
+    this->previewThread->exposureMegapix = this->exposureMegapix;
+    this->previewThread->clearCancel();
+    this->previewThread->start();
+}
+
+void CalibrateArena::previewFinished()
+{
+    if (this->previewPending) {
+        this->runPreview();
+        return;
+    }
+
+    // a preview finishing after the live preview was turned off is stale
+    if (!this->livePreview || this->previewThread == NULL || this->previewThread->wasCancelled()) {
+        return;
+    }
+
+    if (this->previewThread->finalImage.empty()) {
+        emit errorMessage("Preview: stitching failed");
+        return;
+    }
+
+    if (this->displayEnabled) {
+        Mat result;
+        cv::cvtColor(this->previewThread->finalImage, result, CV_BGR2RGB);
+        QImage qimg(result.data, result.cols, result.rows, int(result.step), QImage::Format_RGB888);
+        emit setPreviewImage(QPixmap::fromImage(qimg));
+    }
+
+    emit errorMessage(QString("Preview stitched in %1 s, stitch the full images once it looks right")
+                      .arg(double(TraceRecorder::instance().now() - this->previewStart) / 1e6, 0, 'f', 2));
 }
 
 
 void CalibrateArena::extractFeatures()
 {
+    const vector<Mat> & images = *this->session->images;
 
-    // we need at least one image to work on
-    if (this->cameraCalibrationImages.size() != 4)
+    // we need an image from each camera in the grid
+    if (images.size() != this->cameraCount())
     {
-        emit errorMessage("Incorrect calibration image number");
+        emit errorMessage(QString("Incorrect calibration image number, %1 are needed for a %2x%3 camera grid")
+                          .arg(this->cameraCount()).arg(this->gridRows).arg(this->gridCols));
         return;
     }
 
     // all images must be the same size
-    for (uint i = 1; i < this->cameraCalibrationImages.size(); ++i) {
-        if (this->cameraCalibrationImages[i].size() != this->cameraCalibrationImages[0].size()) {
+    for (uint i = 1; i < images.size(); ++i) {
+        if (images[i].size() != images[0].size()) {
             emit errorMessage("Not all calibration images are the same size");
             return;
         }
     }
 
-    // reset the match flag
-    this->goodMatches = false;
+    qint64 extractionStart = TraceRecorder::instance().now();
+
+    // features are found at the work resolution, so detection cost falls with the square of the scale
+    double workScale = megapixScale(this->workMegapix, images[0].size());
+
+    // set up the vector for each image's features
+    vector<detail::ImageFeatures> * features = new vector<detail::ImageFeatures>(images.size());
+
+    // ROI finder (SURF) - detection is by far the most expensive step, so images already processed with the current
+    // threshold reuse their cached features. The rest are processed concurrently, with the features stored by camera
+    // index so the order is the same as for a sequential run
+    QVector < QByteArray > cacheKeys(int(images.size()));
+    QVector < QFuture < void > > finderJobs;
+    for (uint i = 0; i < images.size(); ++i) {
+        cacheKeys[i] = this->session->imageHashes[i] + QByteArray::number(this->featureFinderThreshold) + "@" + QByteArray::number(workScale);
+        int cached = this->featureCacheKeys.indexOf(cacheKeys[i]);
+        if (cached >= 0) {
+            (*features)[i] = (*this->featureCache)[cached];
+            (*features)[i].img_idx = i;
+        } else {
+            finderJobs.push_back(QtConcurrent::run(findCameraFeatures, images[i], &(*features)[i], this->featureFinderThreshold, int(i), workScale));
+        }
+    }
+    for (int i = 0; i < finderJobs.size(); ++i) {
+        finderJobs[i].waitForFinished();
+    }
+
+    // the new features replace any previous features and matches for these images
+    CalibrationSession * extracted = new CalibrationSession(*this->session);
+    extracted->features = QSharedPointer < const vector < detail::ImageFeatures > > (features);
+    extracted->featureScale = workScale;
+    extracted->matches.clear();
+    extracted->goodMatches = false;
+    this->session = calibrationSessionPtr(extracted);
+
+    // the cache shares the session's features, and only holds the current images so it does not grow without bound
+    this->featureCache = this->session->features;
+    this->featureCacheKeys = cacheKeys;
+
+    this->matchFeatures();
+
+    this->reportTiming(extractionStart);
+
+}
+
+void CalibrateArena::matchFeatures()
+{
+
+    // hold on to the session being matched, as it is replaced with the results
+    calibrationSessionPtr current = this->session;
+
+    // we need features for all the images
+    if (!current->features || current->features->size() != current->images->size()) {
+        return;
+    }
+
+    const vector<Mat> & images = *current->images;
+    const vector<detail::ImageFeatures> & features = *current->features;
 
-    // Set up the small images for visualisation
-    float smallImXRatio = float(this->smallImageSize.x())/cameraCalibrationImages[0].size().width;
-    float smallImYRatio = float(this->smallImageSize.y())/cameraCalibrationImages[0].size().height;
+    // Set up the small images for visualisation (the features are at the work resolution)
+    float smallImXRatio = float(this->smallImageSize.x())/(images[0].size().width*current->featureScale);
+    float smallImYRatio = float(this->smallImageSize.y())/(images[0].size().height*current->featureScale);
 
     // create the small images and populate them from the big images
     vector <Mat *> imgsSmall;
-    for (uint i = 0; i < this->cameraCalibrationImages.size(); ++i) {
+    for (uint i = 0; this->displayEnabled && i < images.size(); ++i) {
         imgsSmall.push_back(new Mat);
-        cv::resize(this->cameraCalibrationImages[i], *imgsSmall[i], Size(this->smallImageSize.x(),this->smallImageSize.y()));
-    }
-
-    // extract information for feature finding, and set up the vectors for each image's features
-    // clear old features
-    this->features.clear();
-    this->features.resize(this->cameraCalibrationImages.size());
-    vector<Size> full_img_sizes(this->cameraCalibrationImages.size());
-    for (uint i = 0; i < this->cameraCalibrationImages.size(); ++i) {
-        full_img_sizes[i] = this->cameraCalibrationImages[i].size();
+        cv::resize(images[i], *imgsSmall[i], Size(this->smallImageSize.x(),this->smallImageSize.y()));
     }
 
-    // create the feature finder
-    Ptr<detail::FeaturesFinder> finder;
-    finder = makePtr<detail::SurfFeaturesFinder>(this->featureFinderThreshold);
-
-    // ROI finder (SURF)
-    for (uint i = 0; i < this->cameraCalibrationImages.size(); ++i) {
-        (*finder)(this->cameraCalibrationImages[i], features[i]);
-        features[i].img_idx = i;
+    for (uint i = 0; i < imgsSmall.size(); ++i) {
         // replace with feedback
         //qDebug() << "Features in image #" << i+1 << ": " << features[i].keypoints.size();
         for (int j = 0; j < features[i].keypoints.size(); ++j) {
@@ -264,27 +488,47 @@ void CalibrateArena::extractFeatures()
         }
     }
 
-    // clear old matches
-    this->pairwise_matches.clear();
-
-    // Pairwise matcher
-    detail::BestOf2NearestMatcher matcher(false, this->matcherThreshold);
-    matcher(features, pairwise_matches);
-    matcher.collectGarbage();
-
-    vector<int> indices = detail::leaveBiggestComponent(features, pairwise_matches, 0.5f);
-
-    // for use with Qt::GlobalColor
-    int c = 6;
+    vector<detail::MatchesInfo> pairwise_matches;
+    vector<int> indices;
+    {
+        ScopedStageTimer timer("matching", "features");
+
+        // Pairwise matcher, on the neighbouring pairs in the camera grid only
+        Mat matchMask = gridMatchMask(this->gridRows, this->gridCols, this->matchDiagonals);
+        indices = matchGridFeatures(features, matchMask, this->matcherThreshold, pairwise_matches);
+        timer.addArg("pairs", countNonZero(matchMask) / 2);
+
+        // record the matches for each pair of images
+        for (uint i = 0; i < pairwise_matches.size(); ++i) {
+            if (pairwise_matches[i].src_img_idx < pairwise_matches[i].dst_img_idx) {
+                QString pair = QString("%1-%2").arg(pairwise_matches[i].src_img_idx).arg(pairwise_matches[i].dst_img_idx);
+                timer.addArg(pair + " matches", pairwise_matches[i].matches.size());
+                timer.addArg(pair + " inliers", pairwise_matches[i].num_inliers);
+            }
+        }
+    }
 
-    for (uint i = 0; i < pairwise_matches.size(); ++i) {
-        int src_ind = pairwise_matches[i].src_img_idx;
-        int dst_ind = pairwise_matches[i].dst_img_idx;
-        vector<DMatch> matches = pairwise_matches[i].matches;
-        if (src_ind < dst_ind) { // only show one-way matches
-            QColor col = (Qt::GlobalColor)(++c);
+    // the matches replace any previous ones for these features
+    CalibrationSession * matched = new CalibrationSession(*current);
+    vector<detail::MatchesInfo> * sessionMatches = new vector<detail::MatchesInfo>;
+    sessionMatches->swap(pairwise_matches);
+    matched->matches = QSharedPointer < const vector < detail::MatchesInfo > > (sessionMatches);
+    matched->goodMatches = indices.size() == images.size();
+    this->session = calibrationSessionPtr(matched);
+
+    const vector<detail::MatchesInfo> & matchList = *this->session->matches;
+
+    // cycle through the twelve Qt::GlobalColor colours from Qt::red to Qt::darkYellow, as there can be more pairs
+    int pair = 0;
+
+    for (uint i = 0; i < matchList.size(); ++i) {
+        int src_ind = matchList[i].src_img_idx;
+        int dst_ind = matchList[i].dst_img_idx;
+        const vector<DMatch> & matches = matchList[i].matches;
+        if (this->displayEnabled && src_ind < dst_ind) { // only show one-way matches
+            QColor col = Qt::GlobalColor(Qt::red + pair++ % 12);
             for (uint j = 0; j < matches.size(); ++j) {
-                DMatch match = matches[j];
+                const DMatch & match = matches[j];
                 circle(*imgsSmall[src_ind], Size(smallImXRatio * features[src_ind].keypoints[match.queryIdx].pt.x,smallImYRatio * features[src_ind].keypoints[match.queryIdx].pt.y), 3.0f, Scalar(col.red(),col.green(),col.blue()));
                 circle(*imgsSmall[dst_ind], Size(smallImXRatio * features[dst_ind].keypoints[match.trainIdx].pt.x,smallImYRatio * features[dst_ind].keypoints[match.trainIdx].pt.y), 3.0f, Scalar(col.red(),col.green(),col.blue()));
             }
@@ -300,19 +544,11 @@ void CalibrateArena::extractFeatures()
         QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
         QPixmap pix = QPixmap::fromImage(qimg);
         // send the pixmap to the respective QLabel
-        if (i == 0) {
-            emit setFeaturesImage0(pix);
-        } else if (i == 1) {
-            emit setFeaturesImage1(pix);
-        } else if (i == 2) {
-            emit setFeaturesImage2(pix);
-        } else if (i == 3) {
-            emit setFeaturesImage3(pix);
-        }
+        emit setFeaturesImage(int(i), pix);
     }
 
-    // check how many images we have in the matched set (must be all for success (i.e. 4))
-    if (indices.size() < 4) {
+    // check how many images we have in the matched set (must be all for success)
+    if (!this->session->goodMatches) {
         emit errorMessage("Cannot match all the images: try reducing the feature and/or match thresholds");
         // delete the small images
         for (uint i = 0; i < imgsSmall.size(); ++i) {
@@ -327,8 +563,7 @@ void CalibrateArena::extractFeatures()
         delete imgsSmall[i];
     }
 
-    // success! Set the match flag
-    this->goodMatches = true;
+    // success!
     emit errorMessage("Features extracted successfully");
 
 }
@@ -337,38 +572,39 @@ void CalibrateArena::stitchImages()
 {
 
     // check that we have features
-    if (!this->goodMatches) {
+    if (!this->session->goodMatches) {
         emit errorMessage("No good matches, please repeat feature extraction");
         return;
     }
 
     // since this process can hang, we use a seperate thread, and allow the user to abort the process by re-calling this
-    // method
+    // method. The thread stops cleanly at the end of its current stage.
     if (thread != NULL && thread->isRunning()) {
 
-        thread->terminate();
-        thread->wait(10);
-        if (thread->isRunning()) {
-            emit errorMessage("Couldn't end stitcher thread");
-        } else {
-            emit errorMessage("Stitcher thread terminated");
-            QPushButton * src = qobject_cast < QPushButton * > (this->sender());
-            if (src) {
-                src->setText("Stitch images");
-            }
-        }
+        thread->requestCancel();
+        emit errorMessage("Cancelling stitch after the current stage...");
         return;
     }
 
+    // the full stitch needs the cores more than the preview does
+    if (this->previewThread != NULL && this->previewThread->isRunning()) {
+        this->previewThread->requestCancel();
+    }
+
     // no stitcher running, so launch a new one (create if necessary
     if (thread == NULL) {
         thread = new stitchThread;
+        connect(this->thread, SIGNAL(finished()), this, SLOT(stitcherFinished()));
+        connect(this->thread, SIGNAL(progress(int,int,QString)), this, SLOT(stitcherProgress(int,int,QString)));
     }
 
-    thread->cameraCalibrationImages = this->cameraCalibrationImages;
-    thread->pairwise_matches = this->pairwise_matches;
-    thread->features = this->features;
-    connect(this->thread, SIGNAL(finished()), this, SLOT(stitcherFinished()));
+    // the thread shares the session, so the images and features are not copied
+    thread->session = this->session;
+    thread->composeScale = megapixScale(this->composeMegapix, (*this->session->images)[0].size());
+    this->applyStitchSettings(thread);
+    this->stitchTimer.start();
+    this->stitchStart = TraceRecorder::instance().now();
+    thread->clearCancel();
     thread->start();
 
     QPushButton * src = qobject_cast < QPushButton * > (this->sender());
@@ -381,59 +617,235 @@ void CalibrateArena::stitchImages()
 
 }
 
+void CalibrateArena::reportTiming(qint64 since)
+{
+    QString summary = TraceRecorder::instance().summarySince(since);
+
+    if (!this->traceFileName.isEmpty()) {
+        if (TraceRecorder::instance().writeChromeTrace(this->traceFileName)) {
+            summary += " (trace: " + this->traceFileName + ")";
+        } else {
+            summary += " (could not write trace file)";
+        }
+    }
+
+    emit timingSummary(summary);
+}
+
+void CalibrateArena::stitcherProgress(int stage, int stageCount, QString name)
+{
+    emit errorMessage(QString("Stitching (%1 s): %2, stage %3 of %4")
+                      .arg(double(this->stitchTimer.elapsed()) / 1000.0, 0, 'f', 1)
+                      .arg(name).arg(stage + 1).arg(stageCount));
+}
+
 void CalibrateArena::stitcherFinished()
 {
     // safety first!
     if (this->thread != NULL) {
 
+        if (this->stitchButton) {
+            this->stitchButton->setText("Stitch images");
+        }
+
+        if (this->thread->wasCancelled()) {
+            emit errorMessage("Stitching cancelled");
+            return;
+        }
+
         if (this->thread->finalImage.size().width < 100) {
+            emit errorMessage("Stitching failed");
             return;
         }
 
-        Mat result = this->thread->finalImage;
+        // new stitch, so any previous corners no longer apply
+        this->arenaCorners.clear();
 
-        // the *2 is an assumption - should always be true...
-        cv::resize(result,result,Size(this->smallImageSize.x()*2, this->smallImageSize.y()*2));
-        cv::cvtColor(result, result, CV_BGR2RGB);
+        if (this->displayEnabled) {
 
-        // convert to C header for easier mem ptr addressing
-        IplImage imageIpl = result;
+            Mat result;
+            cv::resize(this->thread->finalImage, result, this->fitToResultDisplay(this->thread->finalImage.size()), 0, 0, INTER_AREA);
+            cv::cvtColor(result, result, CV_BGR2RGB);
 
-        // create a QImage container pointing to the image data
-        QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
+            // convert to C header for easier mem ptr addressing
+            IplImage imageIpl = result;
 
-        // assign to a QPixmap (may copy)
-        QPixmap pix = QPixmap::fromImage(qimg);
+            // create a QImage container pointing to the image data
+            QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
 
-        emit setStitchedImage(pix);
-        emit errorMessage("Stitching complete");
-        this->stitchButton->setText("Stitch images");
+            // assign to a QPixmap (may copy)
+            QPixmap pix = QPixmap::fromImage(qimg);
+
+            emit setStitchedImage(pix);
+        }
+
+        bool stoppedAtBudget = this->thread->engine == stitchThread::ROTATION && !this->thread->adjusterConverged;
+        emit errorMessage(QString("Stitching complete (%1 s)%2").arg(double(this->stitchTimer.elapsed()) / 1000.0, 0, 'f', 1)
+                          .arg(stoppedAtBudget ? ", bundle adjustment stopped at its budget" : ""));
+        this->reportTiming(this->stitchStart);
+
+        // if the corner markers can be found there is no need to select the corners by hand
+        if (this->detectCorners()) {
+            this->squareArena();
+        }
+    }
+}
+
+bool CalibrateArena::detectCorners()
+{
+    if (this->thread == NULL || this->thread->isRunning() || this->thread->finalImage.size().width < 100) {
+        emit errorMessage("No valid stitched image generated");
+        return false;
+    }
+
+    vector<Point2f> corners;
+    vector<float> radii;
+    int refined = 0;
+    {
+        ScopedStageTimer timer("corner detection", "square");
+        if (!detectCornerMarkers(this->thread->finalImage, corners, &radii)) {
+            emit errorMessage("Could not find the four corner markers, select the corners on the stitched image");
+            return false;
+        }
+
+        // the stitched image is much smaller than the cameras, so each marker is found again in the full resolution
+        // camera that sees it best (furthest from its border) and the centre mapped back to the stitched image
+        ArenaGeometry geometry = this->currentGeometry();
+        const vector<Mat> & images = *this->thread->session->images;
+        for (uint q = 0; q < corners.size(); ++q) {
+            int bestCamera = -1;
+            float bestBorder = 0.0f;
+            Point2f bestPoint;
+            float bestScale = 1.0f;
+            for (uint i = 0; i < geometry.cameraCount() && i < images.size(); ++i) {
+                Mat toCamera = geometry.cameraToStitched(i).inv();
+                vector<Point2f> stitched, camera;
+                stitched.push_back(corners[q]);
+                stitched.push_back(corners[q] + Point2f(radii[q], 0.0f));
+                perspectiveTransform(stitched, camera, toCamera);
+                float border = min(min(camera[0].x, camera[0].y), min(images[i].cols - camera[0].x, images[i].rows - camera[0].y));
+                if (border > bestBorder) {
+                    bestCamera = int(i);
+                    bestBorder = border;
+                    bestPoint = camera[0];
+                    bestScale = float(norm(camera[1] - camera[0])) / max(radii[q], 1.0f);
+                }
+            }
+            if (bestCamera < 0) {
+                continue;
+            }
+
+            // search twice the marker radius, so the stitched estimate can be a little out
+            Point2f centre;
+            if (refineCornerMarker(images[bestCamera], bestPoint, 2.0f * radii[q] * bestScale + 4.0f, centre)) {
+                vector<Point2f> camera(1, centre), stitched;
+                perspectiveTransform(camera, stitched, geometry.cameraToStitched(bestCamera));
+                corners[q] = stitched[0];
+                ++refined;
+            }
+        }
+        timer.addArg("refined", refined);
+    }
+
+    this->setArenaCorners(corners);
+    emit errorMessage(QString("Corner markers detected, %1 of 4 refined at camera resolution").arg(refined));
+    return true;
+}
+
+bool CalibrateArena::stitchImagesBlocking()
+{
+    // check that we have features
+    if (!this->session->goodMatches) {
+        emit errorMessage("No good matches, please repeat feature extraction");
+        return false;
+    }
+
+    if (thread != NULL && thread->isRunning()) {
+        emit errorMessage("Stitcher thread already running");
+        return false;
+    }
+
+    if (thread == NULL) {
+        thread = new stitchThread;
     }
+
+    // the thread shares the session, so the images and features are not copied
+    thread->session = this->session;
+    thread->composeScale = megapixScale(this->composeMegapix, (*this->session->images)[0].size());
+    this->applyStitchSettings(thread);
+    thread->finalImage = Mat();
+
+    // run the stitcher and wait for it - there is no user to abort a hang, so the caller must apply any timeout
+    this->stitchStart = TraceRecorder::instance().now();
+    thread->clearCancel();
+    thread->start();
+    thread->wait();
+    this->reportTiming(this->stitchStart);
+
+    if (thread->finalImage.size().width < 100) {
+        emit errorMessage("Stitching failed");
+        return false;
+    }
+
+    this->arenaCorners.clear();
+    emit errorMessage("Stitching complete");
+    return true;
+}
+
+Mat CalibrateArena::getStitchedImage()
+{
+    if (this->thread == NULL || this->thread->isRunning()) {
+        return Mat();
+    }
+    return this->thread->finalImage;
+}
+
+void CalibrateArena::setArenaCorners(vector<Point2f> corners)
+{
+    this->arenaCorners = corners;
+    if (this->arenaCorners.size() > 4) {
+        this->arenaCorners.resize(4);
+    }
+    this->showStitchedWithCorners();
 }
 
 void CalibrateArena::pointSelected(QPoint point)
 {
 
+    if (this->thread == NULL || this->thread->isRunning() || this->thread->finalImage.size().width < 100) {
+        return;
+    }
+
     if (arenaCorners.size() < 4)
     {
-        arenaCorners.push_back(point);
+        // convert from preview co-ordinates to stitched image co-ordinates
+        Size shown = this->fitToResultDisplay(this->thread->finalImage.size());
+        arenaCorners.push_back(Point2f(float(point.x())*float(this->thread->finalImage.size().width)/float(shown.width),
+                                       float(point.y())*float(this->thread->finalImage.size().height)/float(shown.height)));
     }
 
+    this->showStitchedWithCorners();
+
+}
+
+void CalibrateArena::showStitchedWithCorners()
+{
     // draw points
-    if (this->thread != NULL && !this->thread->isRunning()) {
+    if (this->displayEnabled && this->thread != NULL && !this->thread->isRunning()) {
 
         if (this->thread->finalImage.size().width < 100) {
             return;
         }
 
-        Mat result = this->thread->finalImage;
+        Mat result;
+        cv::resize(this->thread->finalImage, result, this->fitToResultDisplay(this->thread->finalImage.size()), 0, 0, INTER_AREA);
 
-        // the *2 is an assumption - should always be true...
-        cv::resize(result,result,Size(this->smallImageSize.x()*2, this->smallImageSize.y()*2));
+        float xRatio = float(result.cols)/float(this->thread->finalImage.size().width);
+        float yRatio = float(result.rows)/float(this->thread->finalImage.size().height);
 
         // add points
         for (uint i = 0; i < this->arenaCorners.size(); ++i) {
-            circle(result, Size(arenaCorners[i].x(),arenaCorners[i].y()), 3.0f, Scalar(0,255,0));
+            circle(result, Point(arenaCorners[i].x*xRatio,arenaCorners[i].y*yRatio), 3.0f, Scalar(0,255,0));
         }
 
         cv::cvtColor(result, result, CV_BGR2RGB);
@@ -450,7 +862,29 @@ void CalibrateArena::pointSelected(QPoint point)
         emit setStitchedImage(pix);
 
     }
+}
+
+void CalibrateArena::sortCorners(Point2f inputQuad[4])
+{
+    Size finalSize = this->thread->finalImage.size();
+
+    for( size_t i = 0; i < arenaCorners.size(); i++ )
+    {
+        Point2f center = arenaCorners[i];
 
+        if (center.x > finalSize.width/2.0 && center.y > finalSize.height/2.0) {
+            inputQuad[3] = center;
+        }
+        if (center.x > finalSize.width/2.0 && center.y < finalSize.height/2.0) {
+            inputQuad[1] = center;
+        }
+        if (center.x < finalSize.width/2.0 && center.y > finalSize.height/2.0) {
+            inputQuad[2] = center;
+        }
+        if (center.x < finalSize.width/2.0 && center.y < finalSize.height/2.0) {
+            inputQuad[0] = center;
+        }
+    }
 }
 
 void CalibrateArena::squareArena()
@@ -470,58 +904,69 @@ void CalibrateArena::squareArena()
         }
 
         // square the image
+        this->composeSquared(this->currentGeometry(), *this->thread->session->images, this->thread->gains, this->thread->composeScale);
 
-        Point2f inputQuad[4];
-        Point2f outputQuad[4];
-
-        for( size_t i = 0; i < arenaCorners.size(); i++ )
-        {
-            // convert co-ordinates
-            Point center( float(arenaCorners[i].x())*float(this->thread->finalImage.size().width)/float(this->smallImageSize.x()*2) , float(arenaCorners[i].y())*float(this->thread->finalImage.size().height)/float(this->smallImageSize.y()*2) );
+        emit errorMessage("Squaring complete");
 
-            if (center.x > this->thread->finalImage.size().width/2.0 && center.y > this->thread->finalImage.size().height/2) {
-                inputQuad[3] = center;
-            }
-            if (center.x > this->thread->finalImage.size().width/2.0 && center.y < this->thread->finalImage.size().height/2) {
-                inputQuad[1] = center;
-            }
-            if (center.x < this->thread->finalImage.size().width/2.0 && center.y > this->thread->finalImage.size().height/2) {
-                inputQuad[2] = center;
-            }
-            if (center.x < this->thread->finalImage.size().width/2.0 && center.y < this->thread->finalImage.size().height/2) {
-                inputQuad[0] = center;
-            }
-        }
+    }
 
-        outputQuad[0] = Point(0,0);
-        outputQuad[1] = Point(2000,0);
-        outputQuad[2] = Point(0,2000);
-        outputQuad[3] = Point(2000,2000);
+}
 
-        Mat M = getPerspectiveTransform(inputQuad,outputQuad);
-        warpPerspective(this->thread->finalImage, this->fullSizeFinalIm, M, Size(2000,2000));
+void CalibrateArena::composeSquared(const ArenaGeometry & geometry, const vector<Mat> & cameraImages, const vector<double> & gains, double composeScale)
+{
+    ScopedStageTimer timer("squaring", "square");
+
+    // large arenas are only shown at a bounded size, the full resolution arena is written a tile at a time by
+    // writeArenaImage
+    double displayScale = megapixScale(this->squaredDisplayMegapix, geometry.arenaSize);
+    Size displaySize(max(1, cvRound(geometry.arenaSize.width * displayScale)), max(1, cvRound(geometry.arenaSize.height * displayScale)));
+    Mat toDisplay = scaleMatrix(displayScale);
+    timer.addArg("display scale", displayScale);
+
+    // compose the squared image straight from the camera images, rather than re-warping the stitched image, so
+    // each pixel is only interpolated once
+    vector<Mat> composeImages(cameraImages.size());
+    vector<Mat> homographies(composeImages.size());
+    for (uint i = 0; i < composeImages.size(); ++i) {
+        composeImages[i] = cameraImages[i];
+        if (composeScale < 1.0) {
+            cv::resize(composeImages[i], composeImages[i], Size(), composeScale, composeScale, INTER_AREA);
+        }
+        homographies[i] = toDisplay * geometry.cameraToArena(i);
+    }
+    this->fullSizeFinalIm = composeCameras(composeImages, homographies, gains, displaySize, composeScale);
 
-        cv::cvtColor(this->fullSizeFinalIm, this->fullSizeFinalIm, CV_BGR2RGB);
+    cv::cvtColor(this->fullSizeFinalIm, this->fullSizeFinalIm, CV_BGR2RGB);
 
-        // set label
-        Mat shrunkIm = this->fullSizeFinalIm;
+    if (this->displayEnabled) {
 
-        cv::resize(this->fullSizeFinalIm, shrunkIm, Size(this->smallImageSize.x()*2, this->smallImageSize.y()*2));
+        // build the zoom pyramid once, halving down to the preview size, so zooming and panning only draw from it
+        QVector < QPixmap > pyramid;
+        Mat level = this->fullSizeFinalIm;
+        while (true) {
+            QImage qimg(level.data, level.cols, level.rows, int(level.step), QImage::Format_RGB888);
+            pyramid.push_back(QPixmap::fromImage(qimg));
+            if (level.cols / 2 < this->resultDisplaySize.width || level.rows / 2 < this->resultDisplaySize.height) {
+                break;
+            }
+            Mat halved;
+            cv::pyrDown(level, halved);
+            level = halved;
+        }
 
-        // convert to C header for easier mem ptr addressing
-        IplImage imageIpl = shrunkIm;
+        // the overview comes from the coarsest level rather than the full size image
+        Mat shrunkIm;
+        cv::resize(level, shrunkIm, this->fitToResultDisplay(level.size()), 0, 0, INTER_AREA);
 
         // create a QImage container pointing to the image data
-        QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
+        QImage qimg(shrunkIm.data, shrunkIm.cols, shrunkIm.rows, int(shrunkIm.step), QImage::Format_RGB888);
 
         // assign to a QPixmap (may copy)
         QPixmap pix = QPixmap::fromImage(qimg);
 
         emit setSquaredImage(pix);
-        emit errorMessage("Squaring complete");
-
+        emit setSquaredPyramid(pyramid);
     }
-
 }
 
 void CalibrateArena::resetPoint()
@@ -530,37 +975,7 @@ void CalibrateArena::resetPoint()
         arenaCorners.pop_back();
     }
 
-    // draw points
-    if (this->thread != NULL && !this->thread->isRunning()) {
-
-        if (this->thread->finalImage.size().width < 100) {
-            return;
-        }
-
-        Mat result = this->thread->finalImage;
-
-        // the *2 is an assumption - should always be true...
-        cv::resize(result,result,Size(this->smallImageSize.x()*2, this->smallImageSize.y()*2));
-
-        // add points
-        for (uint i = 0; i < this->arenaCorners.size(); ++i) {
-            circle(result, Size(arenaCorners[i].x(),arenaCorners[i].y()), 3.0f, Scalar(0,255,0));
-        }
-
-        cv::cvtColor(result, result, CV_BGR2RGB);
-
-        // convert to C header for easier mem ptr addressing
-        IplImage imageIpl = result;
-
-        // create a QImage container pointing to the image data
-        QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
-
-        // assign to a QPixmap (may copy)
-        QPixmap pix = QPixmap::fromImage(qimg);
-
-        emit setStitchedImage(pix);
-
-    }
+    this->showStitchedWithCorners();
 }
 
 void CalibrateArena::saveCalibration()
@@ -589,89 +1004,395 @@ void CalibrateArena::saveCalibration()
             return;
         }
 
-        // save the data
-        FileStorage fs(fileName.toStdString(),FileStorage::WRITE);
+        if (!this->writeCalibration(fileName)) {
+            return;
+        }
+
+        // the remap tables are large, so they go in a compressed file next to the calibration, and in the binary
+        // calibration which can be mapped without parsing
+        QFileInfo calibrationFile(fileName);
+        QString baseName = calibrationFile.absolutePath() + "/" + calibrationFile.completeBaseName();
+        if (!this->writeRemapTables(baseName + "_remap.yml.gz")) {
+            return;
+        }
+        if (!this->writeBinaryCalibration(baseName + ".kcal")) {
+            return;
+        }
+        emit errorMessage("Calibration, remap tables and binary calibration saved");
 
-        Point2f inputQuad[4];
+        QDir lastDirectory (fileName);
+        lastDirectory.cdUp();
+        settings.setValue ("lastDirOut", lastDirectory.absolutePath());
 
-        for (uint i = 0; i < this->arenaCorners.size(); ++i)
-        {
-            // convert co-ordinates
-            Point center( float(arenaCorners[i].x())*float(this->thread->finalImage.size().width)/float(this->smallImageSize.x()*2) , float(arenaCorners[i].y())*float(this->thread->finalImage.size().height)/float(this->smallImageSize.y()*2) );
+    }
 
-            if (center.x > this->thread->finalImage.size().width/2.0 && center.y > this->thread->finalImage.size().height/2) {
-                inputQuad[3] = center;
-            }
-            if (center.x > this->thread->finalImage.size().width/2.0 && center.y < this->thread->finalImage.size().height/2) {
-                inputQuad[1] = center;
-            }
-            if (center.x < this->thread->finalImage.size().width/2.0 && center.y > this->thread->finalImage.size().height/2) {
-                inputQuad[2] = center;
-            }
-            if (center.x < this->thread->finalImage.size().width/2.0 && center.y < this->thread->finalImage.size().height/2) {
-                inputQuad[0] = center;
-            }
+}
+
+bool CalibrateArena::writeCalibration(QString fileName)
+{
+    if (this->thread == NULL || this->thread->isRunning() || this->thread->finalImage.size().width < 100) {
+        emit errorMessage("No valid stitched image generated");
+        return false;
+    }
+
+    if (arenaCorners.size() < 4) {
+        emit errorMessage("Arena corners for squaring not set");
+        return false;
+    }
+
+    // save the data
+    FileStorage fs(fileName.toStdString(),FileStorage::WRITE);
+
+    if (!fs.isOpened()) {
+        emit errorMessage("Could not open calibration file for writing");
+        return false;
+    }
+
+    this->currentGeometry().write(fs);
+
+    emit errorMessage("Calibration saved");
+    return true;
+}
+
+bool CalibrateArena::writeRemapTables(QString fileName)
+{
+    if (this->thread == NULL || this->thread->isRunning() || this->thread->finalImage.size().width < 100) {
+        emit errorMessage("No valid stitched image generated");
+        return false;
+    }
+
+    if (arenaCorners.size() < 4) {
+        emit errorMessage("Arena corners for squaring not set");
+        return false;
+    }
+
+    FileStorage fs(fileName.toStdString(),FileStorage::WRITE);
+
+    if (!fs.isOpened()) {
+        emit errorMessage("Could not open remap table file for writing");
+        return false;
+    }
+
+    ArenaGeometry geometry = this->currentGeometry();
+
+    fs << "arenaSize" << geometry.arenaSize;
+    fs << "mmPerPixel" << geometry.mmPerPixel;
+    fs << "cameraSize" << geometry.cameraSize;
+    fs << "cameras" << int(geometry.cameraCount());
+
+    // one remap per camera gives its region of the squared arena image directly from the raw frame
+    for (uint i = 0; i < geometry.cameraCount(); ++i) {
+        cameraRemap remapTables = geometry.buildRemap(i);
+        fs << ("roi" + to_string(i)) << remapTables.arenaRoi;
+        fs << ("map1_" + to_string(i)) << remapTables.map1;
+        fs << ("map2_" + to_string(i)) << remapTables.map2;
+    }
+
+    emit errorMessage("Remap tables saved");
+    return true;
+}
+
+bool CalibrateArena::writeBinaryCalibration(QString fileName)
+{
+    if (this->thread == NULL || this->thread->isRunning() || this->thread->finalImage.size().width < 100) {
+        emit errorMessage("No valid stitched image generated");
+        return false;
+    }
+
+    if (arenaCorners.size() < 4) {
+        emit errorMessage("Arena corners for squaring not set");
+        return false;
+    }
+
+    ArenaGeometry geometry = this->currentGeometry();
+
+    vector<cameraRemap> remaps;
+    for (uint i = 0; i < geometry.cameraCount(); ++i) {
+        remaps.push_back(geometry.buildRemap(i));
+    }
+
+    CalibrationFile calibration;
+    calibration.addGeometry(geometry);
+    calibration.addRemaps(remaps, geometry.buildBlendWeights(remaps));
+
+    if (!calibration.write(fileName)) {
+        emit errorMessage(calibration.lastError());
+        return false;
+    }
+
+    emit errorMessage("Binary calibration saved");
+    return true;
+}
+
+bool CalibrateArena::readCalibrationGeometry(QString fileName, ArenaGeometry & geometry)
+{
+    // binary calibrations are recognised by their header, anything else is read as XML
+    CalibrationFile calibration;
+    if (calibration.open(fileName)) {
+        if (!calibration.readGeometry(geometry)) {
+            emit errorMessage("Calibration is missing or incomplete");
+            return false;
         }
+        return true;
+    }
+    if (calibration.isCalibrationFile()) {
+        emit errorMessage(calibration.lastError());
+        return false;
+    }
 
-        fs << "corner1" << inputQuad[0];
-        fs << "corner2" << inputQuad[1];
-        fs << "corner3" << inputQuad[2];
-        fs << "corner4" << inputQuad[3];
+    // OpenCV throws rather than failing when the file is not XML or YAML
+    try {
+        FileStorage fs(fileName.toStdString(), FileStorage::READ);
+        if (!fs.isOpened()) {
+            emit errorMessage(calibration.lastError());
+            return false;
+        }
+        if (!geometry.read(fs)) {
+            emit errorMessage("Calibration is missing or incomplete (calibrations must be re-saved to include the arena geometry)");
+            return false;
+        }
+    } catch (cv::Exception &) {
+        emit errorMessage(fileName + " is not a calibration file");
+        return false;
+    }
+    return true;
+}
 
-        fs << "R" << this->thread->Rs;
-        fs << "K" << this->thread->Ks;
+bool CalibrateArena::arenaExportInputs(vector<Mat> & homographies, Size & arenaSize)
+{
+    if (this->thread == NULL || this->thread->isRunning() || this->thread->finalImage.size().width < 100) {
+        emit errorMessage("No valid stitched image generated");
+        return false;
+    }
 
-        QDir lastDirectory (fileName);
-        lastDirectory.cdUp();
-        settings.setValue ("lastDirOut", lastDirectory.absolutePath());
+    if (arenaCorners.size() < 4) {
+        emit errorMessage("Arena corners for squaring not set");
+        return false;
+    }
+
+    ArenaGeometry geometry = this->currentGeometry();
+
+    homographies.clear();
+    for (uint i = 0; i < geometry.cameraCount(); ++i) {
+        homographies.push_back(geometry.cameraToArena(i));
+    }
+    arenaSize = geometry.arenaSize;
+    return true;
+}
+
+bool CalibrateArena::writeArenaImage(QString fileName)
+{
+    vector<Mat> homographies;
+    Size arenaSize;
+    if (!this->arenaExportInputs(homographies, arenaSize)) {
+        return false;
+    }
+
+    // the tiles are composed from the full resolution cameras
+    TiledArenaWriter writer;
+    writer.setTileSize(this->arenaTileSize);
+    if (!writer.write(*this->thread->session->images, homographies, this->thread->gains, arenaSize, fileName)) {
+        emit errorMessage(writer.lastError());
+        return false;
+    }
+
+    emit errorMessage(QString("Arena image (%1x%2) saved").arg(arenaSize.width).arg(arenaSize.height));
+    return true;
+}
 
+void CalibrateArena::exportArenaImage()
+{
+    // as with the stitcher, pressing the button again cancels a running export
+    if (this->arenaExport.isRunning()) {
+        this->arenaWriter.requestCancel();
+        emit errorMessage("Cancelling arena export after the current tiles...");
+        return;
+    }
+
+    QSettings settings;
+    QString lastDir = settings.value("lastDirOut", QDir::homePath()).toString();
+    QString fileName = QFileDialog::getSaveFileName((QWidget *) sender(), tr("Export Arena Image"), lastDir,
+                                                    tr("Streamed PPM image (*.ppm);; Image per tile (*.png *.jpg *.tif)"));
+
+    if (fileName.isEmpty()) {
+        return;
+    }
+
+    vector<Mat> homographies;
+    if (!this->arenaExportInputs(homographies, this->exportSize)) {
+        return;
+    }
+
+    // the tiles are composed from the full resolution cameras, on the thread pool so the UI stays responsive
+    this->arenaWriter.reset();
+    this->arenaWriter.setTileSize(this->arenaTileSize);
+    this->arenaExport.setFuture(QtConcurrent::run(arenaExportJob(&this->arenaWriter, this->thread->session, homographies,
+                                                                 this->thread->gains, this->exportSize, fileName)));
+    this->exportClock.start();
+    this->arenaExportTimer.start();
+
+    this->exportButton = qobject_cast < QPushButton * > (this->sender());
+    if (this->exportButton) {
+        this->exportButton->setText("Abort export");
+    }
+
+    emit errorMessage("Exporting arena image...");
+}
+
+void CalibrateArena::arenaExportProgress()
+{
+    emit errorMessage(QString("Exporting arena image (%1 s): tile %2 of %3")
+                      .arg(double(this->exportClock.elapsed()) / 1000.0, 0, 'f', 1)
+                      .arg(this->arenaWriter.tilesWritten()).arg(this->arenaWriter.tileCount()));
+}
+
+void CalibrateArena::arenaExportFinished()
+{
+    this->arenaExportTimer.stop();
+    if (this->exportButton) {
+        this->exportButton->setText("Export arena image");
     }
 
+    if (!this->arenaExport.result()) {
+        emit errorMessage(this->arenaWriter.lastError());
+        return;
+    }
+
+    emit errorMessage(QString("Arena image (%1x%2) saved in %3 s").arg(this->exportSize.width).arg(this->exportSize.height)
+                      .arg(double(this->exportClock.elapsed()) / 1000.0, 0, 'f', 1));
 }
 
-void CalibrateArena::zoomMove(QPoint pos)
+bool CalibrateArena::loadCalibration(QString fileName)
 {
+    ArenaGeometry geometry;
+    if (!this->readCalibrationGeometry(fileName, geometry)) {
+        return false;
+    }
+
+    this->loadedGeometry = geometry;
+
+    QString summary = QString("Loaded calibration: %1 cameras (%2x%3 grid) of %4x%5, arena %6x%7, corners")
+            .arg(geometry.cameraCount()).arg(geometry.gridRows).arg(geometry.gridCols)
+            .arg(geometry.cameraSize.width).arg(geometry.cameraSize.height)
+            .arg(geometry.arenaSize.width).arg(geometry.arenaSize.height);
+    for (uint i = 0; i < geometry.corners.size(); ++i) {
+        summary += QString(" (%1, %2)").arg(geometry.corners[i].x, 0, 'f', 1).arg(geometry.corners[i].y, 0, 'f', 1);
+    }
+    if (geometry.mmPerPixel > 0.0) {
+        summary += QString(", %1x%2 mm at %3 mm per pixel").arg(geometry.arenaMillimetres.width).arg(geometry.arenaMillimetres.height)
+                .arg(geometry.mmPerPixel);
+    }
 
-    Size sz(float(pos.x())/float(this->smallImageSize.x()*2)*float(this->fullSizeFinalIm.size().width) , float(pos.y())/float(this->smallImageSize.y()*2)*float(this->fullSizeFinalIm.size().height));
+    // with images from the same cameras loaded, show what the calibration makes of them
+    const vector<Mat> & images = *this->session->images;
+    if (images.size() == geometry.cameraCount() && !images.empty() && images[0].size() == geometry.cameraSize) {
+        vector<Mat> homographies;
+        for (uint i = 0; i < geometry.cameraCount(); ++i) {
+            homographies.push_back(geometry.cameraToArena(i));
+        }
+        vector<double> gains = estimateGains(images, homographies, geometry.arenaSize, this->exposureMegapix);
+        this->composeSquared(geometry, images, gains, megapixScale(this->composeMegapix, geometry.cameraSize));
+    } else {
+        summary += " - load images from these cameras to preview it";
+    }
 
-    if (sz.width < this->smallImageSize.x()) sz.width = this->smallImageSize.x();
-    if (sz.width > this->fullSizeFinalIm.size().width-this->smallImageSize.x()-1) sz.width = this->fullSizeFinalIm.size().width-this->smallImageSize.x()-1;
-    if (sz.height < this->smallImageSize.y()) sz.height = this->smallImageSize.y();
-    if (sz.height > this->fullSizeFinalIm.size().height-this->smallImageSize.y()-1) sz.height = this->fullSizeFinalIm.size().height-this->smallImageSize.y()-1;
+    emit errorMessage(summary);
+    return true;
+}
 
-    // set label
-    Mat shrunkIm = this->fullSizeFinalIm(Rect(sz.width-this->smallImageSize.x(),sz.height-this->smallImageSize.y(),this->smallImageSize.x()*2,this->smallImageSize.y()*2));
+bool CalibrateArena::setWarmStartCalibration(QString fileName)
+{
+    ArenaGeometry geometry;
+    if (!this->readCalibrationGeometry(fileName, geometry)) {
+        return false;
+    }
 
-    Mat s2;
-    shrunkIm.copyTo(s2);
+    this->loadedGeometry = geometry;
+    this->warmStart = true;
+    return true;
+}
 
-    // convert to C header for easier mem ptr addressing
-    IplImage imageIpl = s2;
+void CalibrateArena::applyStitchSettings(stitchThread * stitcher)
+{
+    stitcher->adjusterMaxIterations = this->adjusterMaxIterations;
+    stitcher->adjusterMaxSeconds = this->adjusterMaxSeconds;
+    stitcher->engine = this->stitchEngine;
+    stitcher->exposureMegapix = this->exposureMegapix;
+
+    // the planar engine has no cameras to warm start
+    stitcher->initialKs.clear();
+    stitcher->initialRs.clear();
+    if (!this->warmStart || this->stitchEngine == stitchThread::PLANAR) {
+        return;
+    }
+
+    // the previous calibration must be of the same cameras, at the same resolution
+    const vector<Mat> & images = *stitcher->session->images;
+    if (this->loadedGeometry.isPlanar() || this->loadedGeometry.Ks.size() != images.size() || images.empty() || images[0].size() != this->loadedGeometry.cameraSize) {
+        emit errorMessage("The opened calibration is not of these cameras, estimating them from scratch");
+        return;
+    }
+    stitcher->initialKs = this->loadedGeometry.Ks;
+    stitcher->initialRs = this->loadedGeometry.Rs;
+}
 
-    // create a QImage container pointing to the image data
-    QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
+void CalibrateArena::openCalibration()
+{
+    QSettings settings;
+    QString lastDir = settings.value("lastDirOut", QDir::homePath()).toString();
+    QString fileName = QFileDialog::getOpenFileName((QWidget *) sender(), tr("Open Calibration"), lastDir, tr("Calibration files (*.kcal *.xml);; All files (*)"));
 
-    // assign to a QPixmap (may copy)
-    QPixmap pix = QPixmap::fromImage(qimg);
+    if (fileName.isEmpty()) {
+        return;
+    }
 
-    emit setSquaredImage(pix);
+    this->loadCalibration(fileName);
 }
 
-void CalibrateArena::zoomMoveDone()
+void CalibrateArena::setArenaMetric(double widthMm, double heightMm, double mmPerPixel)
 {
-    // set label
-    Mat shrunkIm;
+    if (widthMm <= 0.0 || heightMm <= 0.0 || mmPerPixel <= 0.0) {
+        emit errorMessage("The arena size and scale must be positive");
+        return;
+    }
+    this->arenaMillimetres = Size2d(widthMm, heightMm);
+    this->mmPerPixel = mmPerPixel;
+}
 
-    cv::resize(this->fullSizeFinalIm, shrunkIm, Size(this->smallImageSize.x()*2, this->smallImageSize.y()*2));
+Size CalibrateArena::getArenaSize()
+{
+    ArenaGeometry geometry;
+    geometry.setMetricSize(this->arenaMillimetres, this->mmPerPixel);
+    return geometry.arenaSize;
+}
 
-    // convert to C header for easier mem ptr addressing
-    IplImage imageIpl = shrunkIm;
+Size CalibrateArena::fitToResultDisplay(Size imageSize)
+{
+    double scale = min(double(this->resultDisplaySize.width) / double(imageSize.width),
+                       double(this->resultDisplaySize.height) / double(imageSize.height));
+    return Size(max(1, cvRound(imageSize.width * scale)), max(1, cvRound(imageSize.height * scale)));
+}
 
-    // create a QImage container pointing to the image data
-    QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
+ArenaGeometry CalibrateArena::currentGeometry()
+{
+    ArenaGeometry geometry;
+
+    geometry.Ks = this->thread->Ks;
+    geometry.gridRows = this->gridRows;
+    geometry.gridCols = this->gridCols;
+    geometry.Rs = this->thread->Rs;
+    geometry.planarHs = this->thread->planarHs;
+    geometry.setMetricSize(this->arenaMillimetres, this->mmPerPixel);
+    geometry.warpScale = this->thread->warpScale;
+    geometry.panoramaRoi = this->thread->panoramaRoi;
+    geometry.stitchedSize = this->thread->finalImage.size();
+    if (!this->thread->session->images->empty()) {
+        geometry.cameraSize = (*this->thread->session->images)[0].size();
+    }
 
-    // assign to a QPixmap (may copy)
-    QPixmap pix = QPixmap::fromImage(qimg);
+    Point2f inputQuad[4];
+    this->sortCorners(inputQuad);
+    geometry.corners.assign(inputQuad, inputQuad + 4);
 
-    emit setSquaredImage(pix);
+    return geometry;
 }
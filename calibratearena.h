@@ -24,8 +24,17 @@ using namespace std;
 #include <QPoint>
 #include <QPixmap>
 #include <QPushButton>
-
-class stitchThread;
+#include <QByteArray>
+#include <QVector>
+#include <QTimer>
+#include <QElapsedTimer>
+#include <QFutureWatcher>
+
+// Project includes
+#include "arenawarp.h"
+#include "calibrationsession.h"
+#include "tiledarenawriter.h"
+#include "stitchthread.h"
 
 /*!
  * \brief The CalibrateArena class
@@ -53,20 +62,40 @@ signals:
      */
     void errorMessage(QString);
 
-    void setImage0(QPixmap);
-    void setImage1(QPixmap);
-    void setImage2(QPixmap);
-    void setImage3(QPixmap);
+    /*!
+     * \brief setImage
+     * Qt signal with the preview of a camera's calibration image, the cameras are numbered along the rows of the grid
+     */
+    void setImage(int, QPixmap);
 
-    void setFeaturesImage0(QPixmap);
-    void setFeaturesImage1(QPixmap);
-    void setFeaturesImage2(QPixmap);
-    void setFeaturesImage3(QPixmap);
+    /*!
+     * \brief setFeaturesImage
+     * Qt signal with the preview of a camera's features and matches
+     */
+    void setFeaturesImage(int, QPixmap);
 
     void setStitchedImage(QPixmap);
 
     void setSquaredImage(QPixmap);
 
+    /*!
+     * \brief setPreviewImage
+     * Qt signal with the result of the last live preview stitch
+     */
+    void setPreviewImage(QPixmap);
+
+    /*!
+     * \brief setSquaredPyramid
+     * Qt signal with the squared image at full resolution and successively halved sizes, for zooming and panning
+     */
+    void setSquaredPyramid(QVector<QPixmap>);
+
+    /*!
+     * \brief timingSummary
+     * Qt signal with a summary of the time spent in each stage of the last extraction or stitch
+     */
+    void timingSummary(QString);
+
 public slots:
 
     /*!
@@ -75,11 +104,20 @@ public slots:
      */
     void extractFeatures();
 
+    /*!
+     * \brief matchFeatures
+     * Match the extracted features between the images. Called by extractFeatures, and again whenever the matcher
+     * threshold changes as this is cheap compared to the feature extraction.
+     */
+    void matchFeatures();
+
     /*!
      * \brief setCalibrationImages
-     * Set the calibration images
+     * Set the calibration images, starting a new session. The pixel data is shared rather than copied, so the
+     * caller must not write to the images afterwards. Capture times are recorded when the images come straight
+     * from the cameras.
      */
-    void setCalibrationImages(vector <Mat>);
+    void setCalibrationImages(const vector <Mat> &, const vector <qint64> & captureTimes = vector <qint64> ());
 
     /*!
      * \brief setFeatureFinderThreshold
@@ -93,6 +131,62 @@ public slots:
      */
     void setMatcherThreshold(int);
 
+    /*!
+     * \brief setWorkMegapix
+     * Accessor slot, the image size in megapixels used for feature detection and matching (<= 0 for full size)
+     */
+    void setWorkMegapix(double);
+
+    /*!
+     * \brief setComposeMegapix
+     * Accessor slot, the image size in megapixels used when warping the cameras into the output (<= 0 for full size)
+     */
+    void setComposeMegapix(double);
+
+    /*!
+     * \brief setAdjusterMaxIterations
+     * Accessor slot, the most iterations bundle adjustment may take
+     */
+    void setAdjusterMaxIterations(int);
+
+    /*!
+     * \brief setAdjusterMaxSeconds
+     * Accessor slot, the most time bundle adjustment may take in seconds (<= 0 for no limit)
+     */
+    void setAdjusterMaxSeconds(double);
+
+    /*!
+     * \brief setWarmStart
+     * Accessor slot, start the stitch from the cameras of the opened calibration rather than estimating them
+     */
+    void setWarmStart(bool);
+
+    /*!
+     * \brief setStitchEngine
+     * Accessor slot, how the stitcher places the cameras (a stitchThread::engineType)
+     */
+    void setStitchEngine(int);
+
+    /*!
+     * \brief setLivePreview
+     * Enable or disable the live preview, a low resolution stitch re-run whenever the images or the feature and
+     * matcher thresholds change
+     */
+    void setLivePreview(bool);
+
+    /*!
+     * \brief runPreview
+     * Find and match features in heavily downscaled images and stitch them in the preview thread. Normally called
+     * through the preview timer, so a burst of changes gives a single preview.
+     */
+    void runPreview();
+
+    /*!
+     * \brief previewFinished
+     * Called by the preview stitcher thread when it completes
+     */
+    void previewFinished();
+
     /*!
      * \brief stitchImages
      * Use the existing feature matches to stitch the images
@@ -105,12 +199,25 @@ public slots:
      */
     void stitcherFinished();
 
+    /*!
+     * \brief stitcherProgress
+     * Called by the stitcher thread as each stage starts
+     */
+    void stitcherProgress(int stage, int stageCount, QString name);
+
     /*!
      * \brief pointSelected
      * Select the points used to square the arena
      */
     void pointSelected(QPoint);
 
+    /*!
+     * \brief detectCorners
+     * Find the corner markers in the full size stitched image and use them as the arena corners, returns true on
+     * success. Called when a stitch completes, and again from the UI.
+     */
+    bool detectCorners();
+
     /*!
      * \brief resetPoint
      * clear last point
@@ -125,42 +232,228 @@ public slots:
 
     /*!
      * \brief saveCalibration
-     * Save the calibration matrices to an OpenCV FileStorage format
+     * Save the calibration matrices to an OpenCV FileStorage format, with the remap tables and binary calibration
      */
     void saveCalibration();
 
     /*!
-     * \brief zoomMove
-     * Slot to facilitate zooming and panning the final image
+     * \brief exportArenaImage
+     * Choose a file and write the full resolution squared arena image to it in the background, or cancel the
+     * export if one is running
+     */
+    void exportArenaImage();
+
+    /*!
+     * \brief arenaExportProgress
+     * Report the tiles written so far while exporting
      */
-    void zoomMove(QPoint);
+    void arenaExportProgress();
 
     /*!
-     * \brief zoomMoveDone
-     * Slot to facilitate finishing zooming and panning the final image
+     * \brief arenaExportFinished
+     * Called when the background arena export completes
      */
-    void zoomMoveDone();
+    void arenaExportFinished();
+
+    /*!
+     * \brief openCalibration
+     * Choose a calibration file to load and inspect
+     */
+    void openCalibration();
 
     /*!
      * \brief getCameraCalibrationImages
-     * Return the vector containing the calibration images
+     * Return the vector containing the calibration images, valid until the images are next set. Use getSession
+     * to keep hold of them for longer.
      */
-     vector<Mat> getCameraCalibrationImages(){
-        return cameraCalibrationImages;
+    const vector<Mat> & getCameraCalibrationImages(){
+        return *this->session->images;
     }
 
+public:
+
+    /*!
+     * \brief setDisplayEnabled
+     * Enable or disable generation of the preview QPixmaps. Disabled when running headless as there is no
+     * display server (and no QGuiApplication) to create them against.
+     */
+    void setDisplayEnabled(bool enabled) { this->displayEnabled = enabled; }
+
+    /*!
+     * \brief setCameraGrid
+     * Set the layout of the cameras over the arena. One calibration image is needed per camera, in order along
+     * the rows of the grid.
+     */
+    void setCameraGrid(int rows, int cols);
+
+    /*!
+     * \brief setPreviewMegapix
+     * The image size in megapixels the live preview stitches at
+     */
+    void setPreviewMegapix(double val) { this->previewMegapix = val; }
+
+    /*!
+     * \brief cameraCount
+     * The number of cameras in the grid
+     */
+    uint cameraCount() { return uint(this->gridRows * this->gridCols); }
+
+    int getGridRows() { return this->gridRows; }
+    int getGridCols() { return this->gridCols; }
+
+    /*!
+     * \brief setMatchDiagonals
+     * Whether diagonally neighbouring cameras in the grid are matched as well as those beside each other, they
+     * only overlap at the corners so can be left out when the corner overlap is small
+     */
+    void setMatchDiagonals(bool enabled) { this->matchDiagonals = enabled; this->schedulePreview(); }
+
+    /*!
+     * \brief setTraceFile
+     * Set where the Chrome trace-event JSON of the pipeline timings is written, an empty name disables it
+     */
+    void setTraceFile(QString fileName) { this->traceFileName = fileName; }
+
+    /*!
+     * \brief hasGoodMatches
+     * True if the last feature extraction matched all the images
+     */
+    bool hasGoodMatches() { return this->session->goodMatches; }
+
+    /*!
+     * \brief getSession
+     * Return the current calibration session, which stays valid however the calibration changes afterwards
+     */
+    calibrationSessionPtr getSession() { return this->session; }
+
+    /*!
+     * \brief stitchImagesBlocking
+     * Run the stitcher thread to completion without returning to the event loop, returns true on success
+     */
+    bool stitchImagesBlocking();
+
+    /*!
+     * \brief getStitchedImage
+     * Return the full size stitched image, empty if no stitch has completed
+     */
+    Mat getStitchedImage();
+
+    /*!
+     * \brief setArenaCorners
+     * Set the arena corners directly, in stitched image co-ordinates (replaces any user selected points)
+     */
+    void setArenaCorners(vector<Point2f>);
+
+    /*!
+     * \brief writeCalibration
+     * Write the calibration matrices to the given file, returns true on success
+     */
+    bool writeCalibration(QString fileName);
+
+    /*!
+     * \brief writeRemapTables
+     * Write fixed-point remap tables taking each raw camera image straight to the squared arena image, returns
+     * true on success. Use a .gz extension to compress the file.
+     */
+    bool writeRemapTables(QString fileName);
+
+    /*!
+     * \brief writeBinaryCalibration
+     * Write the calibration with the remap tables and blend weights in the memory-mappable binary format (see
+     * CalibrationFile), returns true on success
+     */
+    bool writeBinaryCalibration(QString fileName);
+
+    /*!
+     * \brief writeArenaImage
+     * Write the squared arena at full resolution, composed a tile at a time so it need not fit in memory (see
+     * TiledArenaWriter for the file naming). Returns true on success.
+     */
+    bool writeArenaImage(QString fileName);
+
+    /*!
+     * \brief setArenaTileSize
+     * The tile size for writing the arena image
+     */
+    void setArenaTileSize(int size) { this->arenaTileSize = size; }
+
+    /*!
+     * \brief setArenaMetric
+     * Set the physical size of the arena between the corner markers and the scale of the squared arena image, which
+     * together set its size. The scale is stored in the calibration.
+     */
+    void setArenaMetric(double widthMm, double heightMm, double mmPerPixel);
+
+    /*!
+     * \brief getArenaSize
+     * The size of the squared arena image given by the arena size and scale
+     */
+    Size getArenaSize();
+
+    /*!
+     * \brief setResultDisplaySize
+     * The size of the stitched and squared image displays, the images are fitted inside keeping their shape
+     */
+    void setResultDisplaySize(int width, int height) { this->resultDisplaySize = Size(width, height); }
+
+    /*!
+     * \brief loadCalibration
+     * Load a binary or XML calibration, reporting what it contains. If the current calibration images are from the
+     * same cameras, the squared arena they give with this calibration is shown. Returns true on success.
+     */
+    bool loadCalibration(QString fileName);
+
+    /*!
+     * \brief setWarmStartCalibration
+     * Load a previous calibration of the rig and start the stitch from its cameras, so a small recalibration only
+     * needs a few bundle adjustment iterations. Returns true on success.
+     */
+    bool setWarmStartCalibration(QString fileName);
+
+    /*!
+     * \brief getLoadedGeometry
+     * The geometry of the last calibration loaded
+     */
+    ArenaGeometry getLoadedGeometry() { return this->loadedGeometry; }
+
 private:
     // private members
     /*!
-     * \brief cameraCalibrationImages
-     * A vector containing the calibration images from the cameras.
+     * \brief session
+     * The calibration images with their features and matches, replaced as a whole by each stage and shared with
+     * the stitcher thread
      */
-    vector <Mat> cameraCalibrationImages;
+    calibrationSessionPtr session;
     /*!
      * \brief smallImageSize
      * Assigned in the constructor
      */
     QPoint smallImageSize;
+    /*!
+     * \brief resultDisplaySize
+     * The size of the stitched and squared image displays, defaults to twice the small image size
+     */
+    Size resultDisplaySize;
+    /*!
+     * \brief arenaMillimetres, mmPerPixel
+     * The physical size of the arena and the scale of the squared arena image, defaults to 2 m square at 1 mm per
+     * pixel
+     */
+    Size2d arenaMillimetres = Size2d(2000.0, 2000.0);
+    double mmPerPixel = 1.0;
+    /*!
+     * \brief gridRows, gridCols
+     * The layout of the cameras over the arena, defaults to 2x2
+     */
+    int gridRows = 2;
+    int gridCols = 2;
+
+    /*!
+     * \brief matchDiagonals
+     * Flag that diagonally neighbouring cameras are matched, defaults to true
+     */
+    bool matchDiagonals = true;
+
     /*!
      * \brief featureFinderThreshold
      * The threshold value for the Surf feature finder
@@ -174,34 +467,168 @@ private:
     float matcherThreshold = 0.6f; // default
 
     /*!
-     * \brief features
-     * This data must be passed from the feature extraction to the Homography estimator/refiner
+     * \brief workMegapix
+     * The image size for feature detection and matching, in megapixels
+     */
+    double workMegapix = 0.6; // default
+
+    /*!
+     * \brief composeMegapix
+     * The image size for warping into the outputs, in megapixels (<= 0 for full size)
+     */
+    double composeMegapix = -1.0; // default
+
+    /*!
+     * \brief exposureMegapix
+     * The size of the output in megapixels used to estimate the exposure gains, for both the stitcher and loaded
+     * calibrations
+     */
+    double exposureMegapix = 0.1;
+
+    /*!
+     * \brief adjusterMaxIterations, adjusterMaxSeconds
+     * The budget for bundle adjustment
+     */
+    int adjusterMaxIterations = 200; // default
+    double adjusterMaxSeconds = 30.0; // default
+
+    /*!
+     * \brief warmStart
+     * Flag that the stitch starts from the cameras of the loaded calibration, defaults to false
+     */
+    bool warmStart = false;
+
+    /*!
+     * \brief stitchEngine
+     * The stitchThread::engineType to stitch with, defaults to the rotating camera model
+     */
+    int stitchEngine = stitchThread::ROTATION;
+
+    /*!
+     * \brief featureCache
+     * The features found in the last processed images, shared with the session they were extracted for
+     */
+    QSharedPointer < const vector < detail::ImageFeatures > > featureCache;
+    /*!
+     * \brief featureCacheKeys
+     * The key for each entry of the feature cache, from the image hash, the feature finder threshold and work scale
+     */
+    QVector < QByteArray > featureCacheKeys;
+    /*!
+     * \brief rematchTimer
+     * Coalesces matcher threshold changes from the slider into a single re-match
+     */
+    QTimer rematchTimer;
+
+    /*!
+     * \brief livePreview
+     * Flag that the preview stitch re-runs as the parameters change, defaults to false
+     */
+    bool livePreview = false;
+
+    /*!
+     * \brief previewMegapix
+     * The image size for the preview stitch, in megapixels
+     */
+    double previewMegapix = 0.05; // default
+
+    /*!
+     * \brief previewAdjusterMaxIterations, previewAdjusterMaxSeconds
+     * The bundle adjustment budget for the preview, kept short so the preview stays interactive
+     */
+    int previewAdjusterMaxIterations = 50;
+    double previewAdjusterMaxSeconds = 0.5;
+
+    /*!
+     * \brief previewTimer
+     * Debounces changes to the images and thresholds into a single preview
      */
-    vector<detail::ImageFeatures> features;
+    QTimer previewTimer;
+
     /*!
-     * \brief pairwise_matches
-     * This data must be passed from the feature extraction to the Homography estimator/refiner
+     * \brief previewSession
+     * The downscaled images with their features and matches for the preview stitch
      */
-    vector<detail::MatchesInfo> pairwise_matches;
+    calibrationSessionPtr previewSession;
+
     /*!
-     * \brief goodMatches
-     * Flag that we have successful matching of the images, defaults to false
+     * \brief previewThreshold
+     * The feature finder threshold the preview features were found with
      */
-    bool goodMatches = false;
+    int previewThreshold = -1;
+
+    /*!
+     * \brief previewThread
+     * Stitcher thread for the preview, kept separate from the full resolution stitch
+     */
+    stitchThread * previewThread = NULL;
+
+    /*!
+     * \brief previewPending
+     * Flag that the parameters changed while a preview was running, so another is needed when it stops
+     */
+    bool previewPending = false;
+
+    /*!
+     * \brief previewStart
+     * TraceRecorder time the current preview started
+     */
+    qint64 previewStart = 0;
 
     /*!
      * \brief arenaCorners
-     * A vector containing the corners of the arena, used when squaring the stitched image.
-     * Currently these are user selected, however future work may automate corner selection.
+     * A vector containing the corners of the arena in full size stitched image co-ordinates, used when squaring
+     * the stitched image. These are either user selected on the preview or set directly when running headless.
+     */
+    vector < Point2f > arenaCorners;
+
+    /*!
+     * \brief displayEnabled
+     * Flag that the preview QPixmaps should be generated, defaults to true
      */
-    QVector < QPoint > arenaCorners;
+    bool displayEnabled = true;
 
     /*!
      * \brief fullSizeFinalIm
-     * Full size version of the final image. This is used when zooming and panning in the UI
+     * Full size version of the final image (up to squaredDisplayMegapix), the zoom pyramid for the UI is built from this
      */
     Mat fullSizeFinalIm;
 
+    /*!
+     * \brief squaredDisplayMegapix
+     * The largest the squared image is composed for display, in megapixels
+     */
+    double squaredDisplayMegapix = 16.0;
+
+    /*!
+     * \brief arenaTileSize
+     * The tile size for writing the arena image
+     */
+    int arenaTileSize = 1024;
+
+    /*!
+     * \brief arenaWriter, arenaExport
+     * The writer for the background arena export, and the export running on the thread pool
+     */
+    TiledArenaWriter arenaWriter;
+    QFutureWatcher < bool > arenaExport;
+
+    /*!
+     * \brief arenaExportTimer
+     * Polls the export progress, the tiles are written on the pool threads
+     */
+    QTimer arenaExportTimer;
+
+    QPushButton * exportButton = NULL;
+    QElapsedTimer exportClock;
+    Size exportSize;
+
+    /*!
+     * \brief loadedGeometry
+     * The geometry of the last calibration loaded
+     */
+    ArenaGeometry loadedGeometry;
+
     // private methods
     /*!
      * \brief thread
@@ -209,7 +636,86 @@ private:
      */
     stitchThread * thread = NULL;
 
-    QPushButton * stitchButton;
+    QPushButton * stitchButton = NULL;
+
+    /*!
+     * \brief stitchTimer
+     * Time since the current stitch started, for progress reporting
+     */
+    QElapsedTimer stitchTimer;
+
+    /*!
+     * \brief stitchStart
+     * TraceRecorder time the current stitch started, for the timing summary
+     */
+    qint64 stitchStart = 0;
+
+    /*!
+     * \brief traceFileName
+     * Where the trace of the pipeline timings is written, defaults to the temp directory
+     */
+    QString traceFileName;
+
+    /*!
+     * \brief reportTiming
+     * Emit the timing summary for the stages since the given TraceRecorder time and write the trace file
+     */
+    void reportTiming(qint64 since);
+
+    /*!
+     * \brief sortCorners
+     * Sort the arena corners into top-left, top-right, bottom-left, bottom-right order
+     */
+    void sortCorners(Point2f inputQuad[4]);
+
+    /*!
+     * \brief showStitchedWithCorners
+     * Display the stitched image preview with the currently selected corners drawn on it
+     */
+    void showStitchedWithCorners();
+
+    /*!
+     * \brief currentGeometry
+     * Collect the stitcher output and arena corners into the camera to arena geometry
+     */
+    ArenaGeometry currentGeometry();
+
+    /*!
+     * \brief readCalibrationGeometry
+     * Read the geometry from a binary or XML calibration, returns false with an error message on failure
+     */
+    bool readCalibrationGeometry(QString fileName, ArenaGeometry & geometry);
+
+    /*!
+     * \brief applyStitchSettings
+     * Pass the bundle adjustment budget and any warm start cameras to a stitcher thread
+     */
+    void applyStitchSettings(stitchThread * stitcher);
+
+    /*!
+     * \brief schedulePreview
+     * Start or restart the preview timer if the live preview is enabled
+     */
+    void schedulePreview() { if (this->livePreview) this->previewTimer.start(); }
+
+    /*!
+     * \brief composeSquared
+     * Compose the squared arena image from the camera images with the given geometry, and show it
+     */
+    void composeSquared(const ArenaGeometry & geometry, const vector<Mat> & cameraImages, const vector<double> & gains, double composeScale);
+
+    /*!
+     * \brief fitToResultDisplay
+     * The size an image is shown at in the stitched and squared image displays
+     */
+    Size fitToResultDisplay(Size imageSize);
+
+    /*!
+     * \brief arenaExportInputs
+     * The camera to arena homographies and arena size for writing the arena image, returns false (with an error
+     * message) if there is no stitch and corners to write it from
+     */
+    bool arenaExportInputs(vector<Mat> & homographies, Size & arenaSize);
 };
 
 
@@ -0,0 +1,368 @@
+#include "calibrationfile.h"
+
+// zlib for the checksum
+#include <zlib.h>
+
+#include <cstring>
+
+static const char calibrationMagic[8] = {'K','A','C','A','L','I','B','\0'};
+static const qint64 sectionAlignment = 64;
+
+/*!
+ * \brief sectionBytes
+ * The size of a section's data
+ */
+static qint64 sectionBytes(const Mat & data)
+{
+    return qint64(data.total()) * qint64(data.elemSize());
+}
+
+/*!
+ * \brief updateChecksum
+ * Add data to a running CRC-32, in chunks as zlib takes 32 bit lengths
+ */
+static quint32 updateChecksum(quint32 crc, const uchar * data, qint64 length)
+{
+    while (length > 0) {
+        uInt chunk = uInt(qMin(length, qint64(1) << 30));
+        crc = quint32(crc32(crc, data, chunk));
+        data += chunk;
+        length -= chunk;
+    }
+    return crc;
+}
+
+CalibrationFile::CalibrationFile()
+{
+}
+
+CalibrationFile::~CalibrationFile()
+{
+    this->close();
+}
+
+void CalibrationFile::addSection(QString name, const Mat & data)
+{
+    // the data is written in one block, so it must be continuous
+    this->sections.insert(name, data.isContinuous() ? data : data.clone());
+}
+
+void CalibrationFile::addGeometry(const ArenaGeometry & geometry)
+{
+    double params[17] = {
+        geometry.warpScale,
+        double(geometry.panoramaRoi.x), double(geometry.panoramaRoi.y),
+        double(geometry.panoramaRoi.width), double(geometry.panoramaRoi.height),
+        double(geometry.stitchedSize.width), double(geometry.stitchedSize.height),
+        double(geometry.cameraSize.width), double(geometry.cameraSize.height),
+        double(geometry.arenaSize.width), double(geometry.arenaSize.height),
+        double(geometry.gridRows), double(geometry.gridCols),
+        double(geometry.cameraCount()),
+        geometry.arenaMillimetres.width, geometry.arenaMillimetres.height, geometry.mmPerPixel
+    };
+    this->addSection("params", Mat(1, 17, CV_64F, params).clone());
+
+    this->addSection("corners", Mat(geometry.corners).reshape(1).clone());
+
+    // stack the per camera matrices, each camera is three rows. Planar geometry has homographies to the floor in
+    // place of the camera matrices
+    vector < Mat > Ks, Rs, Ps, Hs;
+    for (uint i = 0; i < geometry.cameraCount(); ++i) {
+        Mat K, R, P;
+        if (geometry.isPlanar()) {
+            geometry.planarHs[i].convertTo(P, CV_64F);
+            Ps.push_back(P);
+        } else {
+            geometry.Ks[i].convertTo(K, CV_64F);
+            geometry.Rs[i].convertTo(R, CV_64F);
+            Ks.push_back(K);
+            Rs.push_back(R);
+        }
+        Hs.push_back(geometry.cameraToArena(i));
+    }
+    Mat stacked;
+    if (geometry.isPlanar()) {
+        vconcat(Ps, stacked);
+        this->addSection("P", stacked);
+    } else {
+        vconcat(Ks, stacked);
+        this->addSection("K", stacked);
+        vconcat(Rs, stacked);
+        this->addSection("R", stacked);
+    }
+    vconcat(Hs, stacked);
+    this->addSection("H", stacked);
+}
+
+void CalibrationFile::addRemaps(const vector < cameraRemap > & remaps, const vector < Mat > & weights)
+{
+    Mat rois(int(remaps.size()), 4, CV_32S);
+    for (uint i = 0; i < remaps.size(); ++i) {
+        rois.at<int>(i, 0) = remaps[i].arenaRoi.x;
+        rois.at<int>(i, 1) = remaps[i].arenaRoi.y;
+        rois.at<int>(i, 2) = remaps[i].arenaRoi.width;
+        rois.at<int>(i, 3) = remaps[i].arenaRoi.height;
+
+        this->addSection(QString("map1_%1").arg(i), remaps[i].map1);
+        this->addSection(QString("map2_%1").arg(i), remaps[i].map2);
+        if (i < weights.size()) {
+            this->addSection(QString("weight_%1").arg(i), weights[i]);
+        }
+    }
+    this->addSection("roi", rois);
+}
+
+bool CalibrationFile::write(QString fileName)
+{
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    this->error = "Binary calibrations can only be written on little-endian machines";
+    return false;
+#endif
+
+    // lay out the section table, followed by the data of each section on an aligned offset
+    QVector < calibrationFileSection > table;
+    qint64 offset = qint64(sizeof(calibrationFileHeader)) + qint64(this->sections.size()) * qint64(sizeof(calibrationFileSection));
+    for (QMap < QString, Mat >::const_iterator it = this->sections.constBegin(); it != this->sections.constEnd(); ++it) {
+        QByteArray name = it.key().toLatin1();
+        if (name.size() >= int(sizeof(calibrationFileSection().name))) {
+            this->error = "Section name too long: " + it.key();
+            return false;
+        }
+
+        calibrationFileSection entry;
+        memset(&entry, 0, sizeof(entry));
+        memcpy(entry.name, name.constData(), size_t(name.size()));
+        entry.type = it.value().type();
+        entry.rows = it.value().rows;
+        entry.cols = it.value().cols;
+        offset = (offset + sectionAlignment - 1) / sectionAlignment * sectionAlignment;
+        entry.offset = quint64(offset);
+        offset += sectionBytes(it.value());
+        table.push_back(entry);
+    }
+
+    QFile output(fileName);
+    if (!output.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        this->error = "Could not open " + fileName + " for writing";
+        return false;
+    }
+
+    calibrationFileHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, calibrationMagic, sizeof(header.magic));
+    header.version = currentVersion;
+    header.sectionCount = quint32(table.size());
+    header.dataSize = quint64(offset) - sizeof(calibrationFileHeader);
+
+    // the header is written again at the end with the checksum
+    bool ok = output.write((const char *) &header, sizeof(header)) == qint64(sizeof(header));
+
+    quint32 crc = quint32(crc32(0, Z_NULL, 0));
+    ok = ok && output.write((const char *) table.constData(), qint64(table.size()) * qint64(sizeof(calibrationFileSection)))
+            == qint64(table.size()) * qint64(sizeof(calibrationFileSection));
+    crc = updateChecksum(crc, (const uchar *) table.constData(), qint64(table.size()) * qint64(sizeof(calibrationFileSection)));
+
+    int i = 0;
+    static const char padding[sectionAlignment] = {0};
+    for (QMap < QString, Mat >::const_iterator it = this->sections.constBegin(); ok && it != this->sections.constEnd(); ++it, ++i) {
+        qint64 gap = qint64(table[i].offset) - output.pos();
+        ok = output.write(padding, gap) == gap;
+        crc = updateChecksum(crc, (const uchar *) padding, gap);
+
+        qint64 bytes = sectionBytes(it.value());
+        ok = ok && output.write((const char *) it.value().data, bytes) == bytes;
+        crc = updateChecksum(crc, it.value().data, bytes);
+    }
+
+    header.checksum = crc;
+    ok = ok && output.seek(0) && output.write((const char *) &header, sizeof(header)) == qint64(sizeof(header));
+
+    if (!ok) {
+        this->error = "Error writing " + fileName;
+        return false;
+    }
+    return true;
+}
+
+bool CalibrationFile::open(QString fileName, bool verifyChecksum)
+{
+    this->close();
+    this->sections.clear();
+    this->recognised = false;
+
+#if Q_BYTE_ORDER == Q_BIG_ENDIAN
+    this->error = "Binary calibrations can only be read on little-endian machines";
+    return false;
+#endif
+
+    this->file.setFileName(fileName);
+    if (!this->file.open(QIODevice::ReadOnly)) {
+        this->error = "Could not open " + fileName;
+        return false;
+    }
+
+    qint64 size = this->file.size();
+    if (size < qint64(sizeof(calibrationFileHeader))) {
+        this->error = fileName + " is not a calibration file";
+        this->close();
+        return false;
+    }
+
+    this->mapped = this->file.map(0, size);
+    if (!this->mapped) {
+        this->error = "Could not map " + fileName;
+        this->close();
+        return false;
+    }
+
+    const calibrationFileHeader * header = (const calibrationFileHeader *) this->mapped;
+    if (memcmp(header->magic, calibrationMagic, sizeof(header->magic)) != 0) {
+        this->error = fileName + " is not a calibration file";
+        this->close();
+        return false;
+    }
+    this->recognised = true;
+    if (header->version > currentVersion) {
+        this->error = QString("%1 is calibration version %2, this tool reads up to version %3")
+                .arg(fileName).arg(header->version).arg(currentVersion);
+        this->close();
+        return false;
+    }
+    if (header->dataSize != quint64(size) - sizeof(calibrationFileHeader)
+            || quint64(header->sectionCount) * sizeof(calibrationFileSection) > header->dataSize) {
+        this->error = fileName + " is truncated";
+        this->close();
+        return false;
+    }
+    if (verifyChecksum) {
+        quint32 crc = updateChecksum(quint32(crc32(0, Z_NULL, 0)), this->mapped + sizeof(calibrationFileHeader), qint64(header->dataSize));
+        if (crc != header->checksum) {
+            this->error = fileName + " is corrupt (checksum mismatch)";
+            this->close();
+            return false;
+        }
+    }
+
+    // each section is a Mat header straight onto the mapping, so before making one check that the section's data
+    // lies within the file after the section table, with the size worked out in 64 bits
+    const calibrationFileSection * table = (const calibrationFileSection *) (this->mapped + sizeof(calibrationFileHeader));
+    quint64 tableEnd = sizeof(calibrationFileHeader) + quint64(header->sectionCount) * sizeof(calibrationFileSection);
+    for (quint32 i = 0; i < header->sectionCount; ++i) {
+        const calibrationFileSection & entry = table[i];
+        bool valid = entry.name[sizeof(entry.name) - 1] == '\0' && entry.type == CV_MAT_TYPE(entry.type)
+                && CV_MAT_DEPTH(entry.type) <= CV_64F && entry.rows >= 0 && entry.cols >= 0;
+        quint64 bytes = valid ? quint64(entry.rows) * quint64(entry.cols) * quint64(CV_ELEM_SIZE(entry.type)) : 0;
+        if (!valid || (bytes > 0 && (entry.offset < tableEnd || entry.offset > quint64(size) || bytes > quint64(size) - entry.offset))) {
+            this->error = fileName + " has an invalid section table";
+            this->close();
+            return false;
+        }
+        Mat data;
+        if (bytes > 0) {
+            data = Mat(entry.rows, entry.cols, entry.type, this->mapped + entry.offset);
+        }
+        this->sections.insert(QString::fromLatin1(entry.name), data);
+    }
+
+    return true;
+}
+
+void CalibrationFile::close()
+{
+    this->sections.clear();
+    if (this->mapped) {
+        this->file.unmap(this->mapped);
+        this->mapped = NULL;
+    }
+    if (this->file.isOpen()) {
+        this->file.close();
+    }
+}
+
+bool CalibrationFile::readGeometry(ArenaGeometry & geometry) const
+{
+    Mat params = this->section("params");
+    Mat corners = this->section("corners");
+    Mat Ks = this->section("K");
+    Mat Rs = this->section("R");
+    Mat Ps = this->section("P");
+
+    if (params.type() != CV_64F || params.total() < 14 || corners.type() != CV_32F || corners.total() != 8) {
+        return false;
+    }
+
+    const double * p = params.ptr<double>(0);
+    int cameras = int(p[13]);
+    bool planar = !Ps.empty();
+    if (planar && (Ps.type() != CV_64F || Ps.rows != 3 * cameras || Ps.cols != 3)) {
+        return false;
+    }
+    if (!planar && (Ks.type() != CV_64F || Rs.type() != CV_64F || Ks.rows != 3 * cameras || Rs.rows != 3 * cameras
+                    || Ks.cols != 3 || Rs.cols != 3)) {
+        return false;
+    }
+
+    geometry.warpScale = float(p[0]);
+    geometry.panoramaRoi = Rect(int(p[1]), int(p[2]), int(p[3]), int(p[4]));
+    geometry.stitchedSize = Size(int(p[5]), int(p[6]));
+    geometry.cameraSize = Size(int(p[7]), int(p[8]));
+    geometry.arenaSize = Size(int(p[9]), int(p[10]));
+    geometry.gridRows = int(p[11]);
+    geometry.gridCols = int(p[12]);
+
+    // the physical size was added to the end of the parameters
+    geometry.arenaMillimetres = Size2d();
+    geometry.mmPerPixel = 0.0;
+    if (params.total() >= 17) {
+        geometry.arenaMillimetres = Size2d(p[14], p[15]);
+        geometry.mmPerPixel = p[16];
+    }
+
+    geometry.corners.clear();
+    for (int i = 0; i < 4; ++i) {
+        geometry.corners.push_back(Point2f(corners.at<float>(i, 0), corners.at<float>(i, 1)));
+    }
+
+    // the small matrices are copied, so the geometry outlives the file
+    geometry.Ks.clear();
+    geometry.Rs.clear();
+    geometry.planarHs.clear();
+    for (int i = 0; planar && i < cameras; ++i) {
+        geometry.planarHs.push_back(Ps.rowRange(3 * i, 3 * i + 3).clone());
+    }
+    for (int i = 0; !planar && i < cameras; ++i) {
+        geometry.Ks.push_back(Ks.rowRange(3 * i, 3 * i + 3).clone());
+        Mat R;
+        Rs.rowRange(3 * i, 3 * i + 3).convertTo(R, CV_32F);
+        geometry.Rs.push_back(R);
+    }
+
+    return geometry.isValid();
+}
+
+bool CalibrationFile::readRemaps(int cameras, vector < cameraRemap > & remaps, vector < Mat > & weights) const
+{
+    Mat rois = this->section("roi");
+    if (rois.type() != CV_32S || rois.rows != cameras || rois.cols != 4) {
+        return false;
+    }
+
+    remaps.clear();
+    weights.clear();
+    for (int i = 0; i < cameras; ++i) {
+        cameraRemap remapTables;
+        remapTables.arenaRoi = Rect(rois.at<int>(i, 0), rois.at<int>(i, 1), rois.at<int>(i, 2), rois.at<int>(i, 3));
+        remapTables.map1 = this->section(QString("map1_%1").arg(i));
+        remapTables.map2 = this->section(QString("map2_%1").arg(i));
+
+        // cameras that don't reach the arena have no tables
+        if (remapTables.arenaRoi.area() > 0 && (remapTables.map1.size() != remapTables.arenaRoi.size()
+                                                || remapTables.map2.size() != remapTables.arenaRoi.size())) {
+            return false;
+        }
+        remaps.push_back(remapTables);
+        weights.push_back(this->section(QString("weight_%1").arg(i)));
+    }
+
+    return true;
+}
@@ -0,0 +1,155 @@
+#ifndef CALIBRATIONFILE_H
+#define CALIBRATIONFILE_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+// Qt base include
+#include <QFile>
+#include <QMap>
+#include <QString>
+
+// Project includes
+#include "arenawarp.h"
+
+/*!
+ * \brief The calibrationFileHeader struct
+ * The start of a binary calibration file. All values are little-endian.
+ */
+struct calibrationFileHeader
+{
+    char magic[8];          // "KACALIB" and a terminating zero
+    quint32 version;
+    quint32 sectionCount;
+    quint64 dataSize;       // bytes following the header
+    quint32 checksum;       // CRC-32 of the bytes following the header
+    quint32 reserved;
+};
+
+/*!
+ * \brief The calibrationFileSection struct
+ * An entry in the section table following the header, describing one matrix stored in the file
+ */
+struct calibrationFileSection
+{
+    char name[24];          // zero terminated
+    qint32 type;            // OpenCV matrix type
+    qint32 rows;
+    qint32 cols;
+    quint32 reserved;
+    quint64 offset;         // from the start of the file, aligned to 64 bytes
+};
+
+/*!
+ * \brief The CalibrationFile class
+ *
+ * A versioned binary calibration format, a header and a table of named matrix sections followed by the matrix
+ * data with each section aligned to 64 bytes, and a checksum over everything after the header. Opened files are
+ * memory mapped, and the sections are returned as Mat headers onto the mapping, so large per-pixel tables such as
+ * the remaps and blend weights are used in place with no parsing or copying. The mapped sections are read only and
+ * stay valid while the file is open.
+ *
+ * The arena geometry is stored in the "params", "corners", "K", "R" (or "P" for planar geometry) and "H" sections,
+ * and when written each camera's remap tables and blend weights in "roi", "map1_<camera>", "map2_<camera>" and
+ * "weight_<camera>".
+ */
+class CalibrationFile
+{
+public:
+    static const quint32 currentVersion = 1;
+
+    CalibrationFile();
+    ~CalibrationFile();
+
+    /*!
+     * \brief addSection
+     * Add a matrix to be written, replacing any section with the same name
+     */
+    void addSection(QString name, const Mat & data);
+
+    /*!
+     * \brief addGeometry
+     * Add the sections describing the arena geometry
+     */
+    void addGeometry(const ArenaGeometry & geometry);
+
+    /*!
+     * \brief addRemaps
+     * Add the remap tables and blend weights of each camera
+     */
+    void addRemaps(const vector < cameraRemap > & remaps, const vector < Mat > & weights);
+
+    /*!
+     * \brief write
+     * Write the added sections to a file, returns true on success
+     */
+    bool write(QString fileName);
+
+    /*!
+     * \brief open
+     * Map a calibration file and read its section table, checking the version and (optionally, as it reads the
+     * whole file) the checksum. Returns true on success.
+     */
+    bool open(QString fileName, bool verifyChecksum = true);
+
+    /*!
+     * \brief isCalibrationFile
+     * True if the last file opened starts with the binary calibration header, even if it could not be read because
+     * it is corrupt, truncated or a newer version. Anything else may be an XML calibration.
+     */
+    bool isCalibrationFile() const { return this->recognised; }
+
+    /*!
+     * \brief close
+     * Unmap the file, the Mat headers onto it must no longer be used
+     */
+    void close();
+
+    /*!
+     * \brief hasSection
+     * True if the file has a section of this name
+     */
+    bool hasSection(QString name) const { return this->sections.contains(name); }
+
+    /*!
+     * \brief section
+     * The named section, empty if it is missing
+     */
+    Mat section(QString name) const { return this->sections.value(name); }
+
+    /*!
+     * \brief readGeometry
+     * Read the arena geometry from the sections, returns false if anything is missing
+     */
+    bool readGeometry(ArenaGeometry & geometry) const;
+
+    /*!
+     * \brief readRemaps
+     * Read the remap tables and blend weights of each camera as Mats onto the mapped file, returns false if the
+     * file was written without them
+     */
+    bool readRemaps(int cameras, vector < cameraRemap > & remaps, vector < Mat > & weights) const;
+
+    QString lastError() { return this->error; }
+
+private:
+    // disable copying, as the mapping belongs to the file
+    CalibrationFile(const CalibrationFile &);
+    CalibrationFile & operator=(const CalibrationFile &);
+
+    QFile file;
+    uchar * mapped = NULL;
+    bool recognised = false;
+
+    // the matrices to write, or headers onto the mapped file when opened
+    QMap < QString, Mat > sections;
+
+    QString error;
+};
+
+#endif // CALIBRATIONFILE_H
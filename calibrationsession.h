@@ -0,0 +1,71 @@
+#ifndef CALIBRATIONSESSION_H
+#define CALIBRATIONSESSION_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+#include <opencv2/stitching.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+// Qt base include
+#include <QByteArray>
+#include <QSharedPointer>
+
+/*!
+ * \brief The CalibrationSession struct
+ * An immutable snapshot of the calibration images and the results of feature extraction and matching. A stage that
+ * changes the data builds a new snapshot sharing the unchanged parts of the previous one, so the UI, the feature
+ * extraction and the stitcher thread all refer to a single copy of the pixel, keypoint and match data. Each part is
+ * released as soon as the last snapshot referring to it is dropped.
+ */
+struct CalibrationSession
+{
+    /*!
+     * \brief images
+     * The full resolution calibration images from the cameras
+     */
+    QSharedPointer < const vector < Mat > > images;
+
+    /*!
+     * \brief imageHashes
+     * A hash of the content of each calibration image, used to key the feature cache
+     */
+    vector < QByteArray > imageHashes;
+
+    /*!
+     * \brief captureTimes
+     * The TraceRecorder time each image was grabbed, empty if the images were loaded from files
+     */
+    vector < qint64 > captureTimes;
+
+    /*!
+     * \brief features
+     * The features found in each image, null until extraction has run on these images
+     */
+    QSharedPointer < const vector < detail::ImageFeatures > > features;
+
+    /*!
+     * \brief featureScale
+     * The scale of the images the features were found in, relative to the calibration images
+     */
+    double featureScale = 1.0;
+
+    /*!
+     * \brief matches
+     * The pairwise matches between the features, null until matching has run on these features
+     */
+    QSharedPointer < const vector < detail::MatchesInfo > > matches;
+
+    /*!
+     * \brief goodMatches
+     * Flag that the matches connect all of the images
+     */
+    bool goodMatches = false;
+};
+
+typedef QSharedPointer < const CalibrationSession > calibrationSessionPtr;
+
+#endif // CALIBRATIONSESSION_H
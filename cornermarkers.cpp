@@ -0,0 +1,159 @@
+#include "cornermarkers.h"
+
+// OpenCV includes
+#include <opencv2/imgproc.hpp>
+
+Mat greenness(InputArray image)
+{
+    Mat planes[3];
+    split(image, planes);
+
+    // sum the other channels at 16 bits so they don't saturate before being subtracted
+    Mat others;
+    add(planes[0], planes[2], others, noArray(), CV_16S);
+
+    Mat green;
+    planes[1].convertTo(green, CV_16S);
+
+    Mat result;
+    addWeighted(green, 1.0, others, -0.8, 0.0, result, CV_8U);
+    return result;
+}
+
+/*!
+ * \brief markerCandidates
+ * Threshold the greenness to the candidate marker pixels. The markers are the only strongly green areas, so Otsu
+ * separates them from the floor - with a lower limit in case there is nothing green at all and the threshold lands
+ * in the noise.
+ */
+static Mat markerCandidates(const Mat & green)
+{
+    Mat candidates;
+    double level = threshold(green, candidates, 0, 255, THRESH_BINARY | THRESH_OTSU);
+    if (level < 40) {
+        threshold(green, candidates, 40, 255, THRESH_BINARY);
+    }
+    return candidates;
+}
+
+/*!
+ * \brief blobCentre
+ * The sub-pixel centre of a labelled blob, as its greenness weighted centroid
+ */
+static bool blobCentre(const Mat & green, const Mat & labels, const Mat & stats, int label, Point2f & centre)
+{
+    // weight the blob and a margin around it by greenness, so the soft edge of the marker counts in proportion to
+    // how much of each pixel it covers
+    int margin = 2;
+    Rect box(stats.at<int>(label, CC_STAT_LEFT) - margin, stats.at<int>(label, CC_STAT_TOP) - margin,
+             stats.at<int>(label, CC_STAT_WIDTH) + 2 * margin, stats.at<int>(label, CC_STAT_HEIGHT) + 2 * margin);
+    box &= Rect(Point(0,0), green.size());
+
+    Mat blobMask;
+    dilate(labels(box) == label, blobMask, Mat(), Point(-1,-1), margin);
+    Mat weights = Mat::zeros(box.size(), CV_8U);
+    green(box).copyTo(weights, blobMask);
+
+    Moments m = moments(weights, false);
+    if (m.m00 <= 0) {
+        return false;
+    }
+    centre = Point2f(float(box.x + m.m10 / m.m00), float(box.y + m.m01 / m.m00));
+    return true;
+}
+
+bool detectCornerMarkers(InputArray image, vector < Point2f > & corners, vector < float > * radii)
+{
+    Mat green = greenness(image);
+    Size size = green.size();
+
+    Mat candidates = markerCandidates(green);
+
+    Mat labels, stats, centroids;
+    int count = connectedComponentsWithStats(candidates, labels, stats, centroids, 8, CV_32S);
+
+    // the largest plausible marker in each quadrant, 0 = top-left, 1 = top-right, 2 = bottom-left, 3 = bottom-right
+    int best[4] = {0, 0, 0, 0};
+    int bestArea[4] = {0, 0, 0, 0};
+    int minArea = 9;
+
+    // label 0 is the background
+    for (int i = 1; i < count; ++i) {
+        int area = stats.at<int>(i, CC_STAT_AREA);
+        int w = stats.at<int>(i, CC_STAT_WIDTH);
+        int h = stats.at<int>(i, CC_STAT_HEIGHT);
+
+        // a disc fills pi/4 of its bounding box and is as wide as it is tall, with some allowance for the warp
+        float fill = float(area) / float(w * h);
+        float aspect = float(w) / float(h);
+        if (area < minArea || fill < 0.5f || aspect < 0.5f || aspect > 2.0f) {
+            continue;
+        }
+
+        double cx = centroids.at<double>(i, 0);
+        double cy = centroids.at<double>(i, 1);
+        int quadrant = (cx < size.width / 2.0 ? 0 : 1) + (cy < size.height / 2.0 ? 0 : 2);
+        if (area > bestArea[quadrant]) {
+            best[quadrant] = i;
+            bestArea[quadrant] = area;
+        }
+    }
+
+    for (int q = 0; q < 4; ++q) {
+        if (best[q] == 0) {
+            return false;
+        }
+    }
+
+    corners.resize(4);
+    if (radii) {
+        radii->resize(4);
+    }
+    for (int q = 0; q < 4; ++q) {
+        if (!blobCentre(green, labels, stats, best[q], corners[q])) {
+            return false;
+        }
+        if (radii) {
+            (*radii)[q] = float(sqrt(bestArea[q] / CV_PI));
+        }
+    }
+
+    return true;
+}
+
+bool refineCornerMarker(InputArray image, Point2f approximate, float radius, Point2f & centre)
+{
+    Mat full = image.getMat();
+    int r = cvCeil(radius);
+    Rect window = Rect(cvRound(approximate.x) - r, cvRound(approximate.y) - r, 2 * r + 1, 2 * r + 1) & Rect(Point(0,0), full.size());
+    if (window.area() == 0) {
+        return false;
+    }
+
+    Mat green = greenness(full(window));
+    Mat candidates = markerCandidates(green);
+
+    Mat labels, stats, centroids;
+    int count = connectedComponentsWithStats(candidates, labels, stats, centroids, 8, CV_32S);
+
+    // the blob nearest the approximate centre, label 0 is the background
+    Point2f local = approximate - Point2f(window.tl());
+    int best = 0;
+    double bestDistance = 0.0;
+    for (int i = 1; i < count; ++i) {
+        if (stats.at<int>(i, CC_STAT_AREA) < 9) {
+            continue;
+        }
+        double distance = norm(Point2d(centroids.at<double>(i, 0), centroids.at<double>(i, 1)) - Point2d(local));
+        if (best == 0 || distance < bestDistance) {
+            best = i;
+            bestDistance = distance;
+        }
+    }
+
+    if (best == 0 || !blobCentre(green, labels, stats, best, centre)) {
+        return false;
+    }
+    centre += Point2f(window.tl());
+    return true;
+}
@@ -0,0 +1,38 @@
+#ifndef CORNERMARKERS_H
+#define CORNERMARKERS_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+/*!
+ * \brief greenness
+ * How strongly each pixel of a BGR image is green rather than grey or another colour, as G - 0.8 * (B + R),
+ * saturated to 8 bits. The arena corner markers are green discs, so they stand out in this image while the
+ * white and grey of the arena floor go to zero.
+ */
+Mat greenness(InputArray image);
+
+/*!
+ * \brief detectCornerMarkers
+ * Find the four green corner markers of the arena in a BGR image, returning their centres ordered top-left,
+ * top-right, bottom-left, bottom-right. Candidate blobs are found by thresholding the greenness, and the largest
+ * roughly circular blob in each quadrant of the image is taken as that corner's marker. Each centre is refined to
+ * sub-pixel precision as the greenness weighted centroid of the blob. Returns false unless a marker is found in
+ * every quadrant. If radii is given it receives the radius of each marker, in pixels.
+ */
+bool detectCornerMarkers(InputArray image, vector < Point2f > & corners, vector < float > * radii = NULL);
+
+/*!
+ * \brief refineCornerMarker
+ * Find a marker centre in a window of the given radius around an approximate centre, e.g. in a full resolution
+ * camera image with the approximate centre from the stitched image. The blob nearest the approximate centre is
+ * taken, and its centre is found as in detectCornerMarkers. Returns false if there is no marker in the window.
+ */
+bool refineCornerMarker(InputArray image, Point2f approximate, float radius, Point2f & centre);
+
+#endif // CORNERMARKERS_H
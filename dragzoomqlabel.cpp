@@ -1,10 +1,24 @@
 #include "dragzoomqlabel.h"
 #include <QMouseEvent>
+#include <QWheelEvent>
+#include <QPainter>
 #include <QDebug>
 
 dragZoomQLabel::dragZoomQLabel(QWidget *parent) : QLabel(parent)
 {
+    // ~60 Hz
+    this->refreshTimer.setSingleShot(true);
+    this->refreshTimer.setInterval(16);
+    connect(&this->refreshTimer, SIGNAL(timeout()), this, SLOT(update()));
+}
 
+void dragZoomQLabel::setPyramid(QVector<QPixmap> levels)
+{
+    this->levels = levels;
+    if (this->zoomLevel >= this->levels.size()) {
+        this->zoomLevel = 0;
+    }
+    this->update();
 }
 
 void dragZoomQLabel::mousePressEvent(QMouseEvent *ev)
@@ -13,7 +27,8 @@ void dragZoomQLabel::mousePressEvent(QMouseEvent *ev)
     if (ev->button() == Qt::LeftButton) {
         this->isDragged = true;
         this->setMouseTracking(true);
-        emit moving(QPoint(ev->localPos().x(),ev->localPos().y()));
+        this->dragPos = QPoint(ev->localPos().x(),ev->localPos().y());
+        this->update();
         ev->accept();
     }
 
@@ -23,7 +38,11 @@ void dragZoomQLabel::mouseMoveEvent(QMouseEvent *ev)
 {
 
     if (this->isDragged) {
-        emit moving(QPoint(ev->localPos().x(),ev->localPos().y()));
+        // only store the position, the repaint happens at most once per refresh however fast the events arrive
+        this->dragPos = QPoint(ev->localPos().x(),ev->localPos().y());
+        if (!this->refreshTimer.isActive()) {
+            this->refreshTimer.start();
+        }
     }
     ev->accept();
 
@@ -34,10 +53,51 @@ void dragZoomQLabel::mouseReleaseEvent(QMouseEvent *ev)
 
     if (ev->button() == Qt::LeftButton) {
         this->isDragged = false;
-        emit this->moveDone();
+        this->refreshTimer.stop();
+        this->update();
         this->setMouseTracking(false);
         ev->accept();
     }
 
 }
 
+void dragZoomQLabel::wheelEvent(QWheelEvent *ev)
+{
+
+    if (this->isDragged && !this->levels.isEmpty()) {
+        // wheel forward zooms in towards the full resolution level
+        if (ev->angleDelta().y() > 0 && this->zoomLevel > 0) {
+            --this->zoomLevel;
+        } else if (ev->angleDelta().y() < 0 && this->zoomLevel < this->levels.size() - 1) {
+            ++this->zoomLevel;
+        }
+        this->update();
+    }
+    ev->accept();
+
+}
+
+void dragZoomQLabel::paintEvent(QPaintEvent *ev)
+{
+
+    if (!this->isDragged || this->levels.isEmpty()) {
+        QLabel::paintEvent(ev);
+        return;
+    }
+
+    const QPixmap & level = this->levels[this->zoomLevel];
+    QRect view = this->contentsRect();
+
+    // centre the zoomed view on the same point of the image as the mouse is over in the overview
+    int x = qRound(float(this->dragPos.x() - view.left()) / float(view.width()) * float(level.width())) - view.width() / 2;
+    int y = qRound(float(this->dragPos.y() - view.top()) / float(view.height()) * float(level.height())) - view.height() / 2;
+    x = qBound(0, x, qMax(0, level.width() - view.width()));
+    y = qBound(0, y, qMax(0, level.height() - view.height()));
+
+    // draw the part of the level under the view at 1:1, scaling only if the level is smaller than the view
+    QRect source(x, y, qMin(view.width(), level.width()), qMin(view.height(), level.height()));
+
+    QPainter painter(this);
+    painter.drawPixmap(view, level, source);
+
+}
@@ -2,7 +2,17 @@
 #define DRAGZOOMQLABEL_H
 
 #include <QLabel>
+#include <QPixmap>
+#include <QVector>
+#include <QTimer>
 
+/*!
+ * \brief The dragZoomQLabel class
+ * A QLabel showing an overview image that zooms in while the left button is held, panning with the mouse. The zoom
+ * is drawn straight from a cached pyramid of the full image, and mouse moves are coalesced into at most one repaint
+ * per display refresh, so dragging does not allocate or rescale anything. The mouse wheel steps between the pyramid
+ * levels while zoomed.
+ */
 class dragZoomQLabel : public QLabel
 {
     Q_OBJECT
@@ -10,18 +20,47 @@ class dragZoomQLabel : public QLabel
 public:
     dragZoomQLabel(QWidget *parent = 0);
 
+public slots:
+    /*!
+     * \brief setPyramid
+     * Set the zoom pyramid, from the full resolution image down to the coarsest level
+     */
+    void setPyramid(QVector < QPixmap > levels);
+
 protected slots:
     void mousePressEvent(QMouseEvent *ev);
     void mouseMoveEvent(QMouseEvent *ev);
     void mouseReleaseEvent(QMouseEvent *ev);
-
-signals:
-    void moving(QPoint);
-    void moveDone();
+    void wheelEvent(QWheelEvent *ev);
+    void paintEvent(QPaintEvent *ev);
 
 private:
     bool isDragged = false;
 
+    /*!
+     * \brief levels
+     * The zoom pyramid, level 0 is the full resolution image
+     */
+    QVector < QPixmap > levels;
+
+    /*!
+     * \brief zoomLevel
+     * The pyramid level shown while zoomed
+     */
+    int zoomLevel = 0;
+
+    /*!
+     * \brief dragPos
+     * The latest mouse position, in label co-ordinates
+     */
+    QPoint dragPos;
+
+    /*!
+     * \brief refreshTimer
+     * Coalesces mouse moves into one repaint per display refresh
+     */
+    QTimer refreshTimer;
+
 };
 
 #endif // DRAGZOOMQLABEL_H
@@ -0,0 +1,101 @@
+#include "framecombiner.h"
+
+// OpenCV includes
+#include <opencv2/imgproc.hpp>
+
+/*!
+ * \brief median3
+ * The per-element median of three images, as max(min(a,b), min(max(a,b),c))
+ */
+static Mat median3(const Mat & a, const Mat & b, const Mat & c)
+{
+    Mat low, high, result;
+    cv::min(a, b, low);
+    cv::max(a, b, high);
+    cv::min(high, c, high);
+    cv::max(low, high, result);
+    return result;
+}
+
+FrameCombiner::FrameCombiner(mode combineMode)
+{
+    this->combineMode = combineMode;
+}
+
+void FrameCombiner::add(const Mat & frame)
+{
+    ++this->count;
+    this->frameType = frame.type();
+
+    if (this->combineMode == MEAN) {
+        if (this->sum.empty()) {
+            this->sum = Mat::zeros(frame.size(), CV_MAKETYPE(CV_32F, frame.channels()));
+        }
+        accumulate(frame, this->sum);
+        return;
+    }
+
+    // the capture may reuse the frame's buffer for the next frame, so the remedian keeps its own copy
+    this->push(frame.clone(), 0);
+}
+
+void FrameCombiner::push(const Mat & frame, uint level)
+{
+    if (level == this->pending.size()) {
+        this->pending.push_back(vector < Mat > ());
+    }
+
+    this->pending[level].push_back(frame);
+
+    if (this->pending[level].size() == 3) {
+        Mat median = median3(this->pending[level][0], this->pending[level][1], this->pending[level][2]);
+        this->pending[level].clear();
+        this->push(median, level + 1);
+    }
+}
+
+Mat FrameCombiner::result() const
+{
+    if (this->count == 0) {
+        return Mat();
+    }
+
+    if (this->combineMode == MEAN) {
+        Mat mean;
+        this->sum.convertTo(mean, this->frameType, 1.0 / double(this->count));
+        return mean;
+    }
+
+    // what is left are the incomplete groups, each value standing for 3^level frames. They are averaged weighted by
+    // those counts, so a lone frame has only its share of the say against a median of many, and the combination
+    // stays vectorised
+    Mat combined;
+    double combinedWeight = 0.0;
+    double weight = 1.0;
+    Mat single;
+    int values = 0;
+    for (uint level = 0; level < this->pending.size(); ++level) {
+        for (uint i = 0; i < this->pending[level].size(); ++i) {
+            const Mat & value = this->pending[level][i];
+            single = value;
+            ++values;
+            if (combined.empty()) {
+                value.convertTo(combined, CV_MAKETYPE(CV_32F, value.channels()));
+            } else {
+                double total = combinedWeight + weight;
+                addWeighted(combined, combinedWeight / total, value, weight / total, 0.0, combined, CV_32F);
+            }
+            combinedWeight += weight;
+        }
+        weight *= 3.0;
+    }
+
+    // a power of 3 frames leaves just the median
+    if (values == 1) {
+        return single;
+    }
+
+    Mat result;
+    combined.convertTo(result, this->frameType);
+    return result;
+}
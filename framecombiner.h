@@ -0,0 +1,73 @@
+#ifndef FRAMECOMBINER_H
+#define FRAMECOMBINER_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+/*!
+ * \brief The FrameCombiner class
+ *
+ * Combines successive frames from a camera into a single denoised image, one frame at a time so the frames never
+ * all need to be held in memory. The mean is accumulated in floating point. The median is approximated with a
+ * base 3 remedian: each group of three frames is replaced by its per-pixel median, and so on up the levels, so at
+ * most two frames per level are held (2 log3(K) + 1 frames for K frames). The medians are found with per-element
+ * min and max, which OpenCV vectorises. When K is not a power of 3, the values left in incomplete groups are
+ * averaged, weighted by the number of frames each stands for.
+ */
+class FrameCombiner
+{
+public:
+    /*!
+     * \brief The mode enum
+     * How the frames are combined
+     */
+    enum mode {
+        MEDIAN,
+        MEAN
+    };
+
+    explicit FrameCombiner(mode combineMode = MEDIAN);
+
+    /*!
+     * \brief add
+     * Add a frame, all frames must have the same size and type
+     */
+    void add(const Mat & frame);
+
+    /*!
+     * \brief result
+     * The combination of the frames added so far, with the type of the frames, empty if none have been added
+     */
+    Mat result() const;
+
+    /*!
+     * \brief frameCount
+     * The number of frames added
+     */
+    int frameCount() const { return this->count; }
+
+private:
+    /*!
+     * \brief push
+     * Add a frame to a level of the remedian, replacing each complete group of three with its median on the next
+     * level up
+     */
+    void push(const Mat & frame, uint level);
+
+    mode combineMode;
+    int count = 0;
+    int frameType = -1;
+
+    // the running sum for the mean
+    Mat sum;
+
+    // the frames waiting for a group of three at each level of the remedian
+    vector < vector < Mat > > pending;
+};
+
+#endif // FRAMECOMBINER_H
@@ -0,0 +1,324 @@
+#include "headlessrunner.h"
+
+// QT includes
+#include <QCommandLineParser>
+#include <QTextStream>
+
+// Project includes
+#include "stitchthread.h"
+
+HeadlessRunner::HeadlessRunner(QObject *parent) : QObject(parent)
+{
+    // no display, so don't generate any previews
+    this->calibrater.setDisplayEnabled(false);
+
+    connect(&this->calibrater, SIGNAL(errorMessage(QString)), this, SLOT(printMessage(QString)));
+    connect(&this->calibrater, SIGNAL(timingSummary(QString)), this, SLOT(printMessage(QString)));
+}
+
+void HeadlessRunner::printMessage(QString message)
+{
+    QTextStream(stderr) << message << endl;
+}
+
+int HeadlessRunner::run(QStringList arguments)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription("Calibrate the Kilobot arena cameras without a display");
+    parser.addHelpOption();
+    parser.addPositionalArgument("images", "The calibration images, one per camera in order along the rows of the grid", "image0 image1 ...");
+
+    QCommandLineOption headlessOption("headless", "Run without the user interface");
+    QCommandLineOption fdThreshOption(QStringList() << "fd-threshold", "Feature detector threshold (default 10)", "value", "10");
+    QCommandLineOption matchConfOption(QStringList() << "match-conf", "Matcher confidence limit (default 0.6)", "value", "0.6");
+    QCommandLineOption workMegapixOption(QStringList() << "work-megapix",
+                                         "Image size for feature detection and matching in megapixels, 0 for full size (default 0.6)", "value", "0.6");
+    QCommandLineOption composeMegapixOption(QStringList() << "compose-megapix",
+                                            "Image size for warping into the outputs in megapixels, 0 for full size (default 0)", "value", "0");
+    QCommandLineOption baIterationsOption(QStringList() << "ba-iterations", "Most bundle adjustment iterations (default 200)", "count", "200");
+    QCommandLineOption baSecondsOption(QStringList() << "ba-seconds", "Most bundle adjustment time in seconds, 0 for no limit (default 30)", "value", "30");
+    QCommandLineOption warmStartOption(QStringList() << "warm-start",
+                                       "Start from the cameras of this previous calibration of the rig, rather than estimating them", "calibration");
+    QCommandLineOption planarOption(QStringList() << "planar",
+                                    "Place the cameras on the floor plane with homographies from the matches, rather than"
+                                    " with the rotating camera model and bundle adjustment");
+    QCommandLineOption gridOption(QStringList() << "grid", "The camera grid as rows x columns (default 2x2)", "RxC", "2x2");
+    QCommandLineOption noDiagonalsOption(QStringList() << "no-diagonal-matches",
+                                         "Only match cameras beside each other in the grid, not diagonal neighbours");
+    QCommandLineOption cornersOption(QStringList() << "corners",
+                                     "The four arena corners in stitched image co-ordinates, as x,y;x,y;x,y;x,y"
+                                     " (found from the corner markers if not given)", "corners");
+    QCommandLineOption stitchedOption(QStringList() << "stitched-out",
+                                      "Save the stitched image here, e.g. for reading off the corner co-ordinates", "file");
+    QCommandLineOption outputOption(QStringList() << "o" << "output", "Calibration file to write", "file");
+    QCommandLineOption traceOption(QStringList() << "trace", "Write a Chrome trace-event JSON of the stage timings here", "file");
+    QCommandLineOption compositeOption(QStringList() << "composite",
+                                       "Instead of calibrating, apply this calibration to the camera sources (device indices or video files)"
+                                       " given in place of the images, and report the compositing frame rate and latency", "calibration");
+    QCommandLineOption framesOption(QStringList() << "frames", "Number of frames to composite (default 300)", "count", "300");
+    QCommandLineOption compositeOutOption(QStringList() << "composite-out", "Save the last composited frame here", "file");
+    QCommandLineOption remapOption(QStringList() << "remap-out",
+                                   "Write per-camera remap tables to the squared arena here (use .yml.gz to compress)", "file");
+    QCommandLineOption arenaOption(QStringList() << "arena-out",
+                                   "Write the full resolution squared arena here, a tile at a time (.ppm for a single streamed"
+                                   " file, otherwise one image per tile)", "file");
+    QCommandLineOption tileSizeOption(QStringList() << "tile-size", "Tile size for --arena-out (default 1024)", "pixels", "1024");
+    QCommandLineOption arenaMmOption(QStringList() << "arena-mm",
+                                     "The arena size between the corner markers in millimetres (default 2000x2000)", "WxH",
+                                     "2000x2000");
+    QCommandLineOption mmPerPixelOption(QStringList() << "mm-per-pixel", "The scale of the squared arena image (default 1.0)",
+                                        "mm", "1.0");
+    QCommandLineOption binaryOption(QStringList() << "binary-out",
+                                    "Write the binary calibration, with remap tables and blend weights, here (.kcal)", "file");
+
+    parser.addOption(headlessOption);
+    parser.addOption(fdThreshOption);
+    parser.addOption(matchConfOption);
+    parser.addOption(workMegapixOption);
+    parser.addOption(composeMegapixOption);
+    parser.addOption(baIterationsOption);
+    parser.addOption(baSecondsOption);
+    parser.addOption(warmStartOption);
+    parser.addOption(planarOption);
+    parser.addOption(gridOption);
+    parser.addOption(noDiagonalsOption);
+    parser.addOption(cornersOption);
+    parser.addOption(stitchedOption);
+    parser.addOption(outputOption);
+    parser.addOption(remapOption);
+    parser.addOption(binaryOption);
+    parser.addOption(arenaOption);
+    parser.addOption(tileSizeOption);
+    parser.addOption(arenaMmOption);
+    parser.addOption(mmPerPixelOption);
+
+    parser.addOption(traceOption);
+    parser.addOption(compositeOption);
+    parser.addOption(framesOption);
+    parser.addOption(compositeOutOption);
+
+    parser.process(arguments);
+
+    if (parser.isSet(compositeOption)) {
+        bool ok = false;
+        int frames = parser.value(framesOption).toInt(&ok);
+        if (!ok || frames < 1) {
+            printMessage("Invalid frame count");
+            return 1;
+        }
+        return this->runCompositor(parser.value(compositeOption), parser.positionalArguments(), frames, parser.value(compositeOutOption));
+    }
+
+    QStringList grid = parser.value(gridOption).split('x');
+    if (grid.size() != 2 || grid[0].toInt() < 1 || grid[1].toInt() < 1) {
+        printMessage("Invalid camera grid, expected rows x columns such as 3x2");
+        return 1;
+    }
+    this->calibrater.setCameraGrid(grid[0].toInt(), grid[1].toInt());
+    this->calibrater.setMatchDiagonals(!parser.isSet(noDiagonalsOption));
+
+    QStringList fileNames = parser.positionalArguments();
+    if (uint(fileNames.size()) != this->calibrater.cameraCount()) {
+        printMessage(QString("%1 calibration images are required for a %2 camera grid")
+                     .arg(this->calibrater.cameraCount()).arg(parser.value(gridOption)));
+        return 1;
+    }
+
+    if (!parser.isSet(outputOption) && !parser.isSet(stitchedOption) && !parser.isSet(remapOption) && !parser.isSet(binaryOption)
+            && !parser.isSet(arenaOption)) {
+        printMessage("Nothing to do: give an output calibration (-o, --binary-out, --remap-out), a stitched image"
+                     " (--stitched-out) and/or an arena image (--arena-out)");
+        return 1;
+    }
+
+    // parse the thresholds, using the same units as the UI sliders
+    bool ok = true;
+    int fdThresh = parser.value(fdThreshOption).toInt(&ok);
+    if (!ok) {
+        printMessage("Invalid feature detector threshold");
+        return 1;
+    }
+    double matchConf = parser.value(matchConfOption).toDouble(&ok);
+    if (!ok) {
+        printMessage("Invalid matcher confidence limit");
+        return 1;
+    }
+
+    double workMegapix = parser.value(workMegapixOption).toDouble(&ok);
+    if (!ok) {
+        printMessage("Invalid work megapixels");
+        return 1;
+    }
+    double composeMegapix = parser.value(composeMegapixOption).toDouble(&ok);
+    if (!ok) {
+        printMessage("Invalid compose megapixels");
+        return 1;
+    }
+
+    int baIterations = parser.value(baIterationsOption).toInt(&ok);
+    if (!ok || baIterations < 1) {
+        printMessage("Invalid bundle adjustment iterations");
+        return 1;
+    }
+    double baSeconds = parser.value(baSecondsOption).toDouble(&ok);
+    if (!ok) {
+        printMessage("Invalid bundle adjustment time");
+        return 1;
+    }
+
+    int tileSize = parser.value(tileSizeOption).toInt(&ok);
+    if (!ok || tileSize < 16) {
+        printMessage("Invalid tile size");
+        return 1;
+    }
+
+    QStringList arenaMm = parser.value(arenaMmOption).split('x');
+    double mmPerPixel = parser.value(mmPerPixelOption).toDouble(&ok);
+    if (!ok || mmPerPixel <= 0.0) {
+        printMessage("Invalid millimetres per pixel");
+        return 1;
+    }
+    if (arenaMm.size() != 2 || arenaMm[0].toDouble() <= 0.0 || arenaMm[1].toDouble() <= 0.0) {
+        printMessage("Invalid arena size, expected width x height in millimetres such as 2400x1800");
+        return 1;
+    }
+    this->calibrater.setArenaMetric(arenaMm[0].toDouble(), arenaMm[1].toDouble(), mmPerPixel);
+
+    vector <Point2f> corners;
+    if (parser.isSet(cornersOption)) {
+        QStringList points = parser.value(cornersOption).split(';');
+        for (int i = 0; i < points.size(); ++i) {
+            QStringList coords = points[i].split(',');
+            bool okX = false, okY = false;
+            if (coords.size() == 2) {
+                corners.push_back(Point2f(coords[0].toFloat(&okX), coords[1].toFloat(&okY)));
+            }
+            if (!okX || !okY) {
+                printMessage("Invalid corner co-ordinates: " + points[i]);
+                return 1;
+            }
+        }
+        if (corners.size() != 4) {
+            printMessage("Four arena corners are required");
+            return 1;
+        }
+    }
+
+    vector <Mat> imgs;
+
+    for (int i = 0; i < fileNames.size(); ++i) {
+        imgs.push_back(imread(fileNames[i].toStdString(), CV_LOAD_IMAGE_COLOR));
+        if (!imgs.back().data) {
+            printMessage("Error loading image " + fileNames[i]);
+            return 1;
+        }
+    }
+
+    this->calibrater.setTraceFile(parser.value(traceOption));
+    this->calibrater.setFeatureFinderThreshold(fdThresh);
+    this->calibrater.setWorkMegapix(workMegapix);
+    this->calibrater.setComposeMegapix(composeMegapix);
+    this->calibrater.setAdjusterMaxIterations(baIterations);
+    this->calibrater.setAdjusterMaxSeconds(baSeconds);
+    this->calibrater.setStitchEngine(parser.isSet(planarOption) ? stitchThread::PLANAR : stitchThread::ROTATION);
+    if (parser.isSet(warmStartOption) && !this->calibrater.setWarmStartCalibration(parser.value(warmStartOption))) {
+        return 1;
+    }
+    this->calibrater.setMatcherThreshold(qRound(matchConf * 100.0));
+    this->calibrater.setCalibrationImages(imgs);
+
+    this->calibrater.extractFeatures();
+    if (!this->calibrater.hasGoodMatches()) {
+        return 2;
+    }
+
+    if (!this->calibrater.stitchImagesBlocking()) {
+        return 2;
+    }
+
+    if (parser.isSet(stitchedOption)) {
+        if (!imwrite(parser.value(stitchedOption).toStdString(), this->calibrater.getStitchedImage())) {
+            printMessage("Could not write the stitched image");
+            return 1;
+        }
+    }
+
+    if (!corners.empty()) {
+        this->calibrater.setArenaCorners(corners);
+    } else if (parser.isSet(outputOption) || parser.isSet(remapOption) || parser.isSet(binaryOption) || parser.isSet(arenaOption)) {
+        // no corners given, so they must come from the markers
+        if (!this->calibrater.detectCorners()) {
+            return 2;
+        }
+    }
+
+    if (parser.isSet(outputOption)) {
+        if (!this->calibrater.writeCalibration(parser.value(outputOption))) {
+            return 1;
+        }
+    }
+
+    if (parser.isSet(remapOption)) {
+        if (!this->calibrater.writeRemapTables(parser.value(remapOption))) {
+            return 1;
+        }
+    }
+
+    if (parser.isSet(binaryOption)) {
+        if (!this->calibrater.writeBinaryCalibration(parser.value(binaryOption))) {
+            return 1;
+        }
+    }
+
+    if (parser.isSet(arenaOption)) {
+        this->calibrater.setArenaTileSize(tileSize);
+        if (!this->calibrater.writeArenaImage(parser.value(arenaOption))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int HeadlessRunner::runCompositor(QString calibration, QStringList sources, int frames, QString outputFile)
+{
+    ArenaCompositor compositor;
+
+    if (!compositor.loadCalibration(calibration) || !compositor.openSources(sources)) {
+        printMessage(compositor.lastError());
+        return 1;
+    }
+
+    if (!compositor.startCompositing()) {
+        printMessage(compositor.lastError());
+        return 1;
+    }
+
+    arenaFrame frame;
+    qint64 totalLatency = 0;
+    int received = 0;
+    while (received < frames && compositor.nextFrame(frame)) {
+        totalLatency += frame.readyTime - frame.captureTime;
+        ++received;
+    }
+
+    compositor.stop();
+
+    if (received == 0) {
+        printMessage("No frames composited: " + compositor.lastError());
+        return 2;
+    }
+
+    printMessage(QString("Composited %1 frames at %2 fps, mean latency %3 ms, %4 dropped")
+                 .arg(received)
+                 .arg(compositor.fps(), 0, 'f', 1)
+                 .arg(double(totalLatency) / double(received) / 1e6, 0, 'f', 1)
+                 .arg(compositor.droppedFrames()));
+
+    if (!outputFile.isEmpty() && !imwrite(outputFile.toStdString(), frame.image)) {
+        printMessage("Could not write the composited frame");
+        return 1;
+    }
+
+    return 0;
+}
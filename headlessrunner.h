@@ -0,0 +1,48 @@
+#ifndef HEADLESSRUNNER_H
+#define HEADLESSRUNNER_H
+
+// Qt base include
+#include <QObject>
+#include <QStringList>
+
+// Project includes
+#include "calibratearena.h"
+#include "arenacompositor.h"
+
+/*!
+ * \brief The HeadlessRunner class
+ *
+ * Runs the full calibration pipeline (load images, extract features, stitch, square and save) from the command
+ * line without creating any widgets, so calibrations can be scripted and batched on machines with no display
+ * server. All the processing is done by CalibrateArena, this class only parses the arguments and drives it.
+ */
+class HeadlessRunner : public QObject
+{
+    Q_OBJECT
+public:
+    explicit HeadlessRunner(QObject *parent = 0);
+
+    /*!
+     * \brief run
+     * Parse the command line and run the calibration, returns the process exit code
+     */
+    int run(QStringList arguments);
+
+public slots:
+    /*!
+     * \brief printMessage
+     * Print the calibrater messages to the console
+     */
+    void printMessage(QString);
+
+private:
+    /*!
+     * \brief runCompositor
+     * Composite frames from the sources using a saved calibration, reporting the frame rate and latency
+     */
+    int runCompositor(QString calibration, QStringList sources, int frames, QString outputFile);
+
+    CalibrateArena calibrater;
+};
+
+#endif // HEADLESSRUNNER_H
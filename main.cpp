@@ -1,8 +1,19 @@
 #include "mainwindow.h"
+#include "headlessrunner.h"
 #include <QApplication>
+#include <QCoreApplication>
 
 int main(int argc, char *argv[])
 {
+    // the headless mode must not create a QApplication, as there may be no display server
+    for (int i = 1; i < argc; ++i) {
+        if (QString(argv[i]) == "--headless") {
+            QCoreApplication a(argc, argv);
+            HeadlessRunner runner;
+            return runner.run(a.arguments());
+        }
+    }
+
     QApplication a(argc, argv);
     MainWindow w;
     w.show();
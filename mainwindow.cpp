@@ -4,15 +4,37 @@
 // QT includes
 #include <QLabel>
 #include <QLayout>
+#include <QGridLayout>
 #include <QDebug>
 #include <QSettings>
 #include <QDir>
 #include <QFileDialog>
+#include <QThreadPool>
+#include <QtConcurrent>
+
+// Project includes
+#include "stagetimer.h"
+#include "framecombiner.h"
 
 // STL includes
 #include <vector>
+#include <algorithm>
 
+/*!
+ * \brief grabFrame
+ * Grab a frame from a camera without decoding it, returning the TraceRecorder time the grab completed or -1 on
+ * failure. Run for all the cameras at once so their frames are as close together in time as possible.
+ */
+static qint64 grabFrame(cv::VideoCapture * cap, int camera)
+{
+    ScopedStageTimer timer("grab", "capture");
+    timer.addArg("camera", camera);
 
+    if (!cap->grab()) {
+        return -1;
+    }
+    return TraceRecorder::instance().now();
+}
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
@@ -21,11 +43,19 @@ MainWindow::MainWindow(QWidget *parent) :
     ui->setupUi(this);
 
     // ui signal/slots
-    connect(ui->matcher_conf_slider,SIGNAL(sliderMoved(int)), this, SLOT(matchConfDoubleConvertor(int)));
+    connect(ui->matcher_conf_slider,SIGNAL(valueChanged(int)), this, SLOT(matchConfDoubleConvertor(int)));
 
     // connect up calibrater signal/slots
-    connect(ui->fd_thresh_slider,SIGNAL(sliderMoved(int)),&this->calibrater,SLOT(setFeatureFinderThreshold(int)));
-    connect(ui->matcher_conf_slider,SIGNAL(sliderMoved(int)),&this->calibrater,SLOT(setMatcherThreshold(int)));
+    connect(ui->fd_thresh_slider,SIGNAL(valueChanged(int)),&this->calibrater,SLOT(setFeatureFinderThreshold(int)));
+    connect(ui->matcher_conf_slider,SIGNAL(valueChanged(int)),&this->calibrater,SLOT(setMatcherThreshold(int)));
+    connect(ui->work_megapix_spin,SIGNAL(valueChanged(double)),&this->calibrater,SLOT(setWorkMegapix(double)));
+    connect(ui->compose_megapix_spin,SIGNAL(valueChanged(double)),&this->calibrater,SLOT(setComposeMegapix(double)));
+    connect(ui->live_preview,SIGNAL(toggled(bool)),&this->calibrater,SLOT(setLivePreview(bool)));
+    connect(ui->ba_iterations_spin,SIGNAL(valueChanged(int)),&this->calibrater,SLOT(setAdjusterMaxIterations(int)));
+    connect(ui->ba_seconds_spin,SIGNAL(valueChanged(double)),&this->calibrater,SLOT(setAdjusterMaxSeconds(double)));
+    connect(ui->warm_start,SIGNAL(toggled(bool)),&this->calibrater,SLOT(setWarmStart(bool)));
+    connect(ui->engine_combo,SIGNAL(currentIndexChanged(int)),&this->calibrater,SLOT(setStitchEngine(int)));
+    connect(&calibrater, SIGNAL(setPreviewImage(QPixmap)),ui->preview_image,SLOT(setPixmap(QPixmap)));
 
     connect(ui->load_images, SIGNAL(clicked(bool)), this, SLOT(loadImages()));
     connect(ui->cap_images, SIGNAL(clicked(bool)), this, SLOT(capImages()));
@@ -36,27 +66,43 @@ MainWindow::MainWindow(QWidget *parent) :
     connect(ui->square_arena,SIGNAL(clicked(bool)), &this->calibrater, SLOT(squareArena()));
 
     connect(&this->calibrater,SIGNAL(errorMessage(QString)), ui->error_label, SLOT(setText(QString)));
+    connect(&this->calibrater,SIGNAL(timingSummary(QString)), ui->statusBar, SLOT(showMessage(QString)));
 
-    connect(&calibrater, SIGNAL(setImage0(QPixmap)),ui->im1,SLOT(setPixmap(QPixmap)));
-    connect(&calibrater, SIGNAL(setImage1(QPixmap)),ui->im2,SLOT(setPixmap(QPixmap)));
-    connect(&calibrater, SIGNAL(setImage2(QPixmap)),ui->im3,SLOT(setPixmap(QPixmap)));
-    connect(&calibrater, SIGNAL(setImage3(QPixmap)),ui->im4,SLOT(setPixmap(QPixmap)));
-
-    connect(&calibrater, SIGNAL(setFeaturesImage0(QPixmap)),ui->im1_roi,SLOT(setPixmap(QPixmap)));
-    connect(&calibrater, SIGNAL(setFeaturesImage1(QPixmap)),ui->im2_roi,SLOT(setPixmap(QPixmap)));
-    connect(&calibrater, SIGNAL(setFeaturesImage2(QPixmap)),ui->im3_roi,SLOT(setPixmap(QPixmap)));
-    connect(&calibrater, SIGNAL(setFeaturesImage3(QPixmap)),ui->im4_roi,SLOT(setPixmap(QPixmap)));
+    connect(&calibrater, SIGNAL(setImage(int,QPixmap)),this,SLOT(showCameraImage(int,QPixmap)));
+    connect(&calibrater, SIGNAL(setFeaturesImage(int,QPixmap)),this,SLOT(showFeaturesImage(int,QPixmap)));
 
+    // restore the camera grid from the last session, then lay out a preview for each camera
+    QSettings settings;
+    ui->grid_rows_spin->setValue(settings.value("gridRows", 2).toInt());
+    ui->grid_cols_spin->setValue(settings.value("gridCols", 2).toInt());
+    ui->camera_grid->setLayout(new QGridLayout);
+    ui->features_grid->setLayout(new QGridLayout);
+    this->setCameraGrid();
+    connect(ui->grid_rows_spin, SIGNAL(valueChanged(int)), this, SLOT(setCameraGrid()));
+    connect(ui->grid_cols_spin, SIGNAL(valueChanged(int)), this, SLOT(setCameraGrid()));
+
+    // restore the arena size and scale from the last session
+    ui->arena_width_spin->setValue(settings.value("arenaWidthMm", 2000.0).toDouble());
+    ui->arena_height_spin->setValue(settings.value("arenaHeightMm", 2000.0).toDouble());
+    ui->mm_per_pixel_spin->setValue(settings.value("mmPerPixel", 1.0).toDouble());
+    this->setArenaMetric();
+    connect(ui->arena_width_spin, SIGNAL(valueChanged(double)), this, SLOT(setArenaMetric()));
+    connect(ui->arena_height_spin, SIGNAL(valueChanged(double)), this, SLOT(setArenaMetric()));
+    connect(ui->mm_per_pixel_spin, SIGNAL(valueChanged(double)), this, SLOT(setArenaMetric()));
+
+    this->calibrater.setResultDisplaySize(ui->result->width(), ui->result->height());
     connect(&calibrater, SIGNAL(setStitchedImage(QPixmap)),ui->result,SLOT(setPixmap(QPixmap)));
 
     connect(&calibrater, SIGNAL(setSquaredImage(QPixmap)),ui->result_final,SLOT(setPixmap(QPixmap)));
+    connect(&calibrater, SIGNAL(setSquaredPyramid(QVector<QPixmap>)),ui->result_final,SLOT(setPyramid(QVector<QPixmap>)));
 
     connect(ui->result, SIGNAL(clicked(QPoint)), &this->calibrater, SLOT(pointSelected(QPoint)));
     connect(ui->reset_corners, SIGNAL(clicked(bool)), &this->calibrater, SLOT(resetPoint()));
+    connect(ui->detect_corners, SIGNAL(clicked(bool)), &this->calibrater, SLOT(detectCorners()));
 
-    connect(ui->result_final, SIGNAL(moving(QPoint)), &this->calibrater, SLOT(zoomMove(QPoint)));
-    connect(ui->result_final, SIGNAL(moveDone()), &this->calibrater, SLOT(zoomMoveDone()));
     connect(ui->save_calib, SIGNAL(clicked(bool)), &this->calibrater, SLOT(saveCalibration()));
+    connect(ui->load_calib, SIGNAL(clicked(bool)), &this->calibrater, SLOT(openCalibration()));
+    connect(ui->export_arena, SIGNAL(clicked(bool)), &this->calibrater, SLOT(exportArenaImage()));
 }
 
 MainWindow::~MainWindow()
@@ -64,15 +110,85 @@ MainWindow::~MainWindow()
     delete ui;
 }
 
+void MainWindow::setArenaMetric()
+{
+    double width = ui->arena_width_spin->value();
+    double height = ui->arena_height_spin->value();
+    double mmPerPixel = ui->mm_per_pixel_spin->value();
+
+    this->calibrater.setArenaMetric(width, height, mmPerPixel);
+
+    Size arenaSize = this->calibrater.getArenaSize();
+    ui->arena_pixels_label->setText(QString("%1x%2 px").arg(arenaSize.width).arg(arenaSize.height));
+
+    QSettings settings;
+    settings.setValue("arenaWidthMm", width);
+    settings.setValue("arenaHeightMm", height);
+    settings.setValue("mmPerPixel", mmPerPixel);
+}
+
+void MainWindow::setCameraGrid()
+{
+    int rows = ui->grid_rows_spin->value();
+    int cols = ui->grid_cols_spin->value();
+
+    this->calibrater.setCameraGrid(rows, cols);
+
+    QSettings settings;
+    settings.setValue("gridRows", rows);
+    settings.setValue("gridCols", cols);
+
+    // replace the preview labels with one per camera, laid out as the cameras are over the arena
+    qDeleteAll(this->imageLabels);
+    qDeleteAll(this->featureLabels);
+    this->imageLabels.clear();
+    this->featureLabels.clear();
+
+    QGridLayout * imageLayout = qobject_cast < QGridLayout * > (ui->camera_grid->layout());
+    QGridLayout * featureLayout = qobject_cast < QGridLayout * > (ui->features_grid->layout());
+    imageLayout->setContentsMargins(0,0,0,0);
+    imageLayout->setSpacing(0);
+    featureLayout->setContentsMargins(0,0,0,0);
+    featureLayout->setSpacing(0);
+
+    for (int i = 0; i < rows * cols; ++i) {
+        QLabel * imageLabel = new QLabel(ui->camera_grid);
+        imageLabel->setScaledContents(true);
+        imageLayout->addWidget(imageLabel, i / cols, i % cols);
+        this->imageLabels.push_back(imageLabel);
+
+        QLabel * featureLabel = new QLabel(ui->features_grid);
+        featureLabel->setScaledContents(true);
+        featureLayout->addWidget(featureLabel, i / cols, i % cols);
+        this->featureLabels.push_back(featureLabel);
+    }
+}
+
+void MainWindow::showCameraImage(int camera, QPixmap pix)
+{
+    if (camera >= 0 && camera < this->imageLabels.size()) {
+        this->imageLabels[camera]->setPixmap(pix);
+    }
+}
+
+void MainWindow::showFeaturesImage(int camera, QPixmap pix)
+{
+    if (camera >= 0 && camera < this->featureLabels.size()) {
+        this->featureLabels[camera]->setPixmap(pix);
+    }
+}
+
 void MainWindow::loadImages()
 {
 
+    uint cameras = this->calibrater.cameraCount();
+
     QSettings settings;
     QString lastDir = settings.value("lastDir", QDir::homePath()).toString();
-    QStringList fileNames = QFileDialog::getOpenFileNames(this, tr("Load the Four Calibration Images"), lastDir, tr("Image files (*.jpg *.png);; All files (*)"));
+    QStringList fileNames = QFileDialog::getOpenFileNames(this, tr("Load the %1 Calibration Images, in Camera Order").arg(cameras), lastDir, tr("Image files (*.jpg *.png);; All files (*)"));
 
-    if (fileNames.size() != 4) {
-        ui->error_label->setText("Four calibration images are required");
+    if (uint(fileNames.size()) != cameras) {
+        ui->error_label->setText(QString::number(cameras) + " calibration images are required");
         return;
     }
 
@@ -96,40 +212,88 @@ void MainWindow::loadImages()
 void MainWindow::capImages()
 {
 
-    vector <Mat> imgs;
+    uint cameras = this->calibrater.cameraCount();
 
-    // try to open and capture images from 4 cameras
-    for (uint i = 0; i < 4; ++i) {
+    // open all the cameras before grabbing anything, so the slow device setup doesn't separate the frames in time
+    vector < Ptr < cv::VideoCapture > > caps;
+    for (uint i = 0; i < cameras; ++i) {
 
-        cv::VideoCapture cap(i);
+        Ptr < cv::VideoCapture > cap = makePtr < cv::VideoCapture > (int(i));
 
-        if (!cap.isOpened()) {
-            this->ui->error_label->setText(QString("Only ")+QString::number(i) + QString(" cameras were found, 4 are required for calibration"));
+        if (!cap->isOpened()) {
+            this->ui->error_label->setText(QString("Only ")+QString::number(i) + QString(" cameras were found, ") + QString::number(cameras) + QString(" are required for calibration"));
             return;
-        } else {
-            cap.set(CV_CAP_PROP_FRAME_WIDTH, 2048);
-            cap.set(CV_CAP_PROP_FRAME_HEIGHT, 1536);
+        }
+        cap->set(CV_CAP_PROP_FRAME_WIDTH, 2048);
+        cap->set(CV_CAP_PROP_FRAME_HEIGHT, 1536);
+        caps.push_back(cap);
+    }
+
+    // several frames from each camera can be combined to reduce the noise, each is added as it arrives so the
+    // frames are not all held in memory
+    int frames = this->ui->frames_spin->value();
+    FrameCombiner::mode combineMode = this->ui->combine_combo->currentIndex() == 0 ? FrameCombiner::MEDIAN : FrameCombiner::MEAN;
+    vector <FrameCombiner> combiners(cameras, FrameCombiner(combineMode));
+
+    QThreadPool grabPool;
+    grabPool.setMaxThreadCount(int(cameras));
+    vector <qint64> grabTimes;
+
+    for (int f = 0; f < frames; ++f) {
+
+        // grab from every camera at once, with a thread each so none waits for a free thread
+        QVector < QFuture < qint64 > > grabs;
+        for (uint i = 0; i < cameras; ++i) {
+            grabs.push_back(QtConcurrent::run(&grabPool, grabFrame, caps[i].get(), int(i)));
+        }
+
+        for (uint i = 0; i < cameras; ++i) {
+            qint64 grabTime = grabs[i].result();
+            if (grabTime < 0) {
+                this->ui->error_label->setText(QString("Could not grab a frame from camera ") + QString::number(i));
+                return;
+            }
+            // the first frames are the ones recorded as the capture time
+            if (f == 0) {
+                grabTimes.push_back(grabTime);
+            }
+        }
+
+        // decoding the grabbed frames is the slow part, and doesn't need to be in sync
+        for (uint i = 0; i < cameras; ++i) {
             Mat frame;
-            cap >> frame;
-            imgs.push_back(frame);
-            cap.release();
+            if (!caps[i]->retrieve(frame) || frame.empty()) {
+                this->ui->error_label->setText(QString("Could not retrieve the frame from camera ") + QString::number(i));
+                return;
+            }
+            combiners[i].add(frame);
         }
+    }
 
+    vector <Mat> imgs;
+    for (uint i = 0; i < cameras; ++i) {
+        imgs.push_back(combiners[i].result());
+        caps[i]->release();
     }
 
     // can't get here if there is a problem, so send the images to the calibrater
-    this->calibrater.setCalibrationImages(imgs);
+    this->calibrater.setCalibrationImages(imgs, grabTimes);
+
+    qint64 spread = *max_element(grabTimes.begin(), grabTimes.end()) - *min_element(grabTimes.begin(), grabTimes.end());
+    this->ui->error_label->setText(QString("Captured %1 frames from %2 cameras, grabbed within %3 ms")
+                                   .arg(frames).arg(cameras).arg(double(spread) / 1000.0, 0, 'f', 1));
 
 }
 
 
 void MainWindow::saveImages()
 {
-    // Get the captured calibration images
-    vector <Mat>calibrationimages= this->calibrater.getCameraCalibrationImages();
+    // Get the captured calibration images, keeping hold of the session so they stay valid while saving
+    calibrationSessionPtr session = this->calibrater.getSession();
+    const vector <Mat> & calibrationimages = *session->images;
 
     // Check if the image were already/correctly captured
-    if( calibrationimages.size() == 4 ){
+    if( !calibrationimages.empty() && calibrationimages.size() == this->calibrater.cameraCount() ){
 
             //Get the images name prefix
             QString name_prefix= ui->lineEdit->text();
@@ -150,7 +314,7 @@ void MainWindow::saveImages()
             compression_params.push_back(95);
 
             //Save the captured images one by one
-            for (uint i = 0; i < 4; ++i) {
+            for (uint i = 0; i < calibrationimages.size(); ++i) {
                 imwrite(dir.toStdString()+"/"+name_prefix.toStdString()+to_string(i)+".jpg",calibrationimages[i],compression_params);
             }
 
@@ -171,156 +335,3 @@ void MainWindow::matchConfDoubleConvertor(int val)
 {
     ui->match_conf_label->setText(QString::number(float(val)/100.0f));
 }
-
-/*!
- * \brief MainWindow::testStitching
- *
- * A method used to initially test the stitching in OpenCV - will be moved to the
- * calibration class once finalised
- */
-void MainWindow::testStitching()
-{
-/*
-    Mat res2;
-    cv::cvtColor(result, res2, CV_BGR2GRAY);
-    //cv::threshold(res2, res2, 30, 50, cv::THRESH_BINARY + cv::THRESH_OTSU);
-
-   // GaussianBlur(res2,res2,Size(0,0),20);
-    vector<Vec3f> circles;
-
-    */
-
-    //HoughCircles(res2,circles,CV_HOUGH_GRADIENT,1/* rez scaling (1 = full rez, 2 = half etc)*/,15 /* Canny threshold*/,120 /*cicle algorithm accuracy*/,10/* circle distance*/,7/* min circle size*/,11/* max circle size*/);
-
-    /*
-
-    qDebug() << "Found" << circles.size() << "circles";
-
-    for( size_t i = 0; i < circles.size(); i++ )
-    {
-         Point center(cvRound(circles[i][0]), cvRound(circles[i][1]));
-         int radius = cvRound(circles[i][2]);
-         // draw the circle center
-         //circle( result, center, 3, Scalar(0,255,0), -1, 8, 0 );
-         // draw the circle outline
-         circle( result, center, radius, Scalar(0,0,255), 3, 8, 0 );
-    }
-    circle( result, Point(10,20), 5, Scalar(0,255,0), 2, 8, 0 );
-    circle( result, Point(500,500), 5, Scalar(0,255,0), 2, 8, 0 );
-    circle( result, Point(10,500), 5, Scalar(0,255,0), 2, 8, 0 );
-    circle( result, Point(500,20), 5, Scalar(0,255,0), 2, 8, 0 );
-
-    Mat planes[3];
-    split(result,planes);
-    Mat res3 = planes[1]-0.8*(planes[0]+planes[2]);
-
-    */
-
-    //HoughCircles(res3,circles,CV_HOUGH_GRADIENT,1/* rez scaling (1 = full rez, 2 = half etc)*/,200 /* Canny threshold*/,200 /*cicle algorithm accuracy*/,10/* circle distance*/,0/* min circle size*/,11/* max circle size*/);
-
-    /*
-
-    Point2f inputQuad[4];
-    Point2f outputQuad[4];
-
-    outputQuad[0] = Point(0,0);
-    outputQuad[1] = Point(ui->result->width(),0);
-    outputQuad[2] = Point(0,ui->result->height());
-    outputQuad[3] = Point(ui->result->width(),ui->result->height());
-
-    // sort centres
-    for( size_t i = 0; i < circles.size(); i++ )
-    {
-        Point center(cvRound(circles[i][0]), cvRound(circles[i][1]));
-
-        if (center.x > 200 && center.y > 200) {
-            inputQuad[3] = center;
-        }
-        if (center.x > 200 && center.y < 200) {
-            inputQuad[1] = center;
-        }
-        if (center.x < 200 && center.y > 200) {
-            inputQuad[2] = center;
-        }
-        if (center.x < 200 && center.y < 200) {
-            inputQuad[0] = center;
-        }
-    }
-
-    Mat M = getPerspectiveTransform(inputQuad,outputQuad);
-    Mat result2;
-    warpPerspective(result, result2, M, Size(ui->result->width(),ui->result->height()));
-
-    // goodFeaturesToTrack
-
-
-
-//    Canny( res2, res2, 0, 10, 3 );
-
-//    findContours(res2, contours, RETR_LIST, CHAIN_APPROX_SIMPLE);
-
-//    drawContours(result,contours,-1,Scalar(255,0,0));
-
-//    vector<vector<Point> > squares;
-
-//    vector<Point> approx;
-
-//    for( size_t i = 0; i < contours.size(); i++ )
-//    {
-//        // approximate contour with accuracy proportional
-//        // to the contour perimeter
-//        approxPolyDP(Mat(contours[i]), approx, arcLength(Mat(contours[i]), true)*0.1, true);
-
-//        // square contours should have 4 vertices after approximation
-//        // relatively large area (to filter out noisy contours)
-//        // and be convex.
-//        // Note: absolute value of an area is used because
-//        // area may be positive or negative - in accordance with the
-//        // contour orientation
-//        if( approx.size() == 4 &&
-//            fabs(contourArea(Mat(approx))) > 1000 &&
-//            isContourConvex(Mat(approx)) )
-//        {
-//            double maxCosine = 0;
-
-//            for( int j = 2; j < 5; j++ )
-//            {
-//                // find the maximum cosine of the angle between joint edges
-//                double cosine = fabs(angle(approx[j%4], approx[j-2], approx[j-1]));
-//                maxCosine = MAX(maxCosine, cosine);
-//            }
-
-//            // if cosines of all angles are small
-//            // (all angles are ~90 degree) then write quandrange
-//            // vertices to resultant sequence
-//            //if( maxCosine < 0.9 )
-//                squares.push_back(approx);
-//        }
-//    }
-
-//    for( size_t i = 0; i < squares.size(); i++ )
-//    {
-//        const Point* p = &squares[i][0];
-//        int n = (int)squares[i].size();
-//        polylines(result, &p, &n, 1, true, Scalar(0,255,0), 3, 0);
-//    }
-
-    imwrite("/Users/alex/result.jpg",result);
-    cv::resize(result,result,Size(ui->result->width(),ui->result->height()));
-    cv::cvtColor(result2, result2, CV_BGR2RGB);
-
-    // convert to C format
-    IplImage imageIpl = result2;
-
-    // create a QImage container pointing to the image data
-    QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_RGB888);
-    //QImage qimg((uchar *) imageIpl.imageData,imageIpl.width,imageIpl.height,QImage::Format_Grayscale8);
-
-    // assign to a QPixmap (may copy)
-    QPixmap pix = QPixmap::fromImage(qimg);
-
-    // display image
-    //pix = pix.scaled(ui->result->size());
-    ui->result->setPixmap(pix);
-*/
-}
@@ -14,6 +14,8 @@
 using namespace cv;
 
 #include <QMainWindow>
+#include <QLabel>
+#include <QVector>
 
 // Project includes
 #include "calibratearena.h"
@@ -56,14 +58,38 @@ public slots:
      */
     void saveImages();
 
+    /*!
+     * \brief setCameraGrid
+     * Apply the camera grid from the UI, laying out a preview label for each camera
+     */
+    void setCameraGrid();
+
+    /*!
+     * \brief setArenaMetric
+     * Apply the arena size and squared image scale from the UI
+     */
+    void setArenaMetric();
+
+    /*!
+     * \brief showCameraImage
+     * Show a camera's calibration image preview in its place in the grid
+     */
+    void showCameraImage(int, QPixmap);
+
+    /*!
+     * \brief showFeaturesImage
+     * Show a camera's features preview in its place in the grid
+     */
+    void showFeaturesImage(int, QPixmap);
 
 private:
     Ui::MainWindow *ui;
 
-    // private methods
-    void testStitching();
-
     CalibrateArena calibrater;
+
+    // the preview labels for each camera, created for the camera grid
+    QVector < QLabel * > imageLabels;
+    QVector < QLabel * > featureLabels;
 };
 
 #endif // MAINWINDOW_H
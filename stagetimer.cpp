@@ -0,0 +1,141 @@
+#include "stagetimer.h"
+
+// QT includes
+#include <QThread>
+#include <QFile>
+#include <QMap>
+#include <QStringList>
+#include <algorithm>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+
+TraceRecorder::TraceRecorder()
+{
+    this->clock.start();
+}
+
+TraceRecorder & TraceRecorder::instance()
+{
+    static TraceRecorder recorder;
+    return recorder;
+}
+
+qint64 TraceRecorder::now()
+{
+    return this->clock.nsecsElapsed() / 1000;
+}
+
+void TraceRecorder::record(const traceEvent & event)
+{
+    QMutexLocker locker(&this->mutex);
+    if (this->events.size() >= maxEvents) {
+        this->events.remove(0, maxEvents / 10);
+    }
+    this->events.push_back(event);
+}
+
+QVector < QPair < QString, qint64 > > TraceRecorder::totalsSince(qint64 start)
+{
+    QMutexLocker locker(&this->mutex);
+
+    // gather the intervals of each stage, keeping the order in which the stages first appear
+    QVector < QPair < QString, qint64 > > totals;
+    QVector < QVector < QPair < qint64, qint64 > > > intervals;
+    QMap < QString, int > indices;
+    for (int i = 0; i < this->events.size(); ++i) {
+        if (this->events[i].start < start) {
+            continue;
+        }
+        if (!indices.contains(this->events[i].name)) {
+            indices[this->events[i].name] = totals.size();
+            totals.push_back(qMakePair(this->events[i].name, qint64(0)));
+            intervals.push_back(QVector < QPair < qint64, qint64 > > ());
+        }
+        intervals[indices[this->events[i].name]].push_back(qMakePair(this->events[i].start, this->events[i].start + this->events[i].duration));
+    }
+
+    // stages run for each camera at once overlap, so the total is the wall time covered by the union of the intervals
+    for (int i = 0; i < totals.size(); ++i) {
+        std::sort(intervals[i].begin(), intervals[i].end());
+        qint64 covered = 0;
+        qint64 end = intervals[i][0].first;
+        for (int j = 0; j < intervals[i].size(); ++j) {
+            qint64 from = qMax(intervals[i][j].first, end);
+            if (intervals[i][j].second > from) {
+                covered += intervals[i][j].second - from;
+                end = intervals[i][j].second;
+            }
+        }
+        totals[i].second = covered;
+    }
+
+    return totals;
+}
+
+QString TraceRecorder::summarySince(qint64 start)
+{
+    QVector < QPair < QString, qint64 > > totals = this->totalsSince(start);
+
+    QStringList parts;
+    for (int i = 0; i < totals.size(); ++i) {
+        parts.push_back(QString("%1 %2 s").arg(totals[i].first).arg(double(totals[i].second) / 1e6, 0, 'f', 2));
+    }
+    return parts.join(", ");
+}
+
+bool TraceRecorder::writeChromeTrace(QString fileName)
+{
+    QJsonArray traceEvents;
+
+    {
+        QMutexLocker locker(&this->mutex);
+        for (int i = 0; i < this->events.size(); ++i) {
+            QJsonObject event;
+            event["name"] = this->events[i].name;
+            event["cat"] = this->events[i].category;
+            event["ph"] = QString("X");
+            event["ts"] = double(this->events[i].start);
+            event["dur"] = double(this->events[i].duration);
+            event["pid"] = 1;
+            event["tid"] = double(this->events[i].threadId);
+            if (!this->events[i].args.isEmpty()) {
+                QJsonObject args;
+                for (int j = 0; j < this->events[i].args.size(); ++j) {
+                    args[this->events[i].args[j].first] = this->events[i].args[j].second;
+                }
+                event["args"] = args;
+            }
+            traceEvents.push_back(event);
+        }
+    }
+
+    QJsonObject trace;
+    trace["traceEvents"] = traceEvents;
+    trace["displayTimeUnit"] = QString("ms");
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        return false;
+    }
+    return file.write(QJsonDocument(trace).toJson(QJsonDocument::Compact)) >= 0;
+}
+
+ScopedStageTimer::ScopedStageTimer(QString name, QString category)
+{
+    this->event.name = name;
+    this->event.category = category;
+    this->event.threadId = qint64(quintptr(QThread::currentThreadId()));
+    this->event.start = TraceRecorder::instance().now();
+}
+
+ScopedStageTimer::~ScopedStageTimer()
+{
+    this->event.duration = TraceRecorder::instance().now() - this->event.start;
+    TraceRecorder::instance().record(this->event);
+}
+
+void ScopedStageTimer::addArg(QString name, double value)
+{
+    this->event.args.push_back(qMakePair(name, value));
+}
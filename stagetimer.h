@@ -0,0 +1,105 @@
+#ifndef STAGETIMER_H
+#define STAGETIMER_H
+
+// Qt base include
+#include <QString>
+#include <QVector>
+#include <QPair>
+#include <QMutex>
+#include <QElapsedTimer>
+
+/*!
+ * \brief The traceEvent struct
+ * A completed, timed stage of the calibration pipeline, times are in microseconds from the start of the recording
+ */
+struct traceEvent
+{
+    QString name;
+    QString category;
+    qint64 start = 0;
+    qint64 duration = 0;
+    qint64 threadId = 0;
+    QVector < QPair < QString, double > > args;
+};
+
+/*!
+ * \brief The TraceRecorder class
+ *
+ * Collects the timed stages of the calibration pipeline from all threads, so the time spent in each stage can be
+ * summarised in the UI and written out as a Chrome trace-event JSON file (open it in chrome://tracing or Perfetto).
+ */
+class TraceRecorder
+{
+public:
+    /*!
+     * \brief instance
+     * The process wide recorder
+     */
+    static TraceRecorder & instance();
+
+    /*!
+     * \brief now
+     * The current time in microseconds on the recording clock
+     */
+    qint64 now();
+
+    /*!
+     * \brief record
+     * Add a completed event, thread safe
+     */
+    void record(const traceEvent & event);
+
+    /*!
+     * \brief totalsSince
+     * The wall time in microseconds spent in each stage that started after the given time, with the stage names
+     * in the order they first appear. Stages running on several threads at once are only counted once.
+     */
+    QVector < QPair < QString, qint64 > > totalsSince(qint64 start);
+
+    /*!
+     * \brief summarySince
+     * A one line summary of the total time spent in each stage that started after the given time
+     */
+    QString summarySince(qint64 start);
+
+    /*!
+     * \brief writeChromeTrace
+     * Write all the recorded events as a Chrome trace-event JSON file, returns true on success
+     */
+    bool writeChromeTrace(QString fileName);
+
+private:
+    TraceRecorder();
+
+    QElapsedTimer clock;
+    QMutex mutex;
+    QVector < traceEvent > events;
+
+    /*!
+     * \brief maxEvents
+     * Limit on the recorded events, the oldest are discarded beyond this
+     */
+    static const int maxEvents = 100000;
+};
+
+/*!
+ * \brief The ScopedStageTimer class
+ * Times a pipeline stage from construction to destruction and records it with the TraceRecorder
+ */
+class ScopedStageTimer
+{
+public:
+    explicit ScopedStageTimer(QString name, QString category = "calibration");
+    ~ScopedStageTimer();
+
+    /*!
+     * \brief addArg
+     * Attach a value (e.g. a keypoint or match count) to the recorded event
+     */
+    void addArg(QString name, double value);
+
+private:
+    traceEvent event;
+};
+
+#endif // STAGETIMER_H
@@ -0,0 +1,398 @@
+#include "stitchthread.h"
+
+// OpenCV includes
+#include <opencv2/imgproc.hpp>
+#include <opencv2/calib3d.hpp>
+#include <opencv2/stitching/detail/util.hpp>
+
+// Qt includes
+#include <QElapsedTimer>
+
+#include <cfloat>
+
+// bundle adjustment runs in chunks of this many iterations, checking the budget and for cancellation between them
+static const int adjusterChunk = 10;
+
+/*!
+ * \brief camerasSettled
+ * True if no camera moved appreciably between two bundle adjustment chunks
+ */
+static bool camerasSettled(const vector<detail::CameraParams> & before, const vector<detail::CameraParams> & after)
+{
+    for (size_t i = 0; i < before.size(); ++i) {
+        if (abs(after[i].focal - before[i].focal) > 1e-6 * before[i].focal
+                || abs(after[i].ppx - before[i].ppx) > 1e-6 * before[i].focal
+                || abs(after[i].ppy - before[i].ppy) > 1e-6 * before[i].focal
+                || norm(after[i].R, before[i].R, NORM_INF) > 1e-6) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*!
+ * \brief The homographyChainer struct
+ * Visits the edges of the matches spanning tree outwards from the reference camera, giving each camera the
+ * homography to the reference through the camera it is reached from
+ */
+struct homographyChainer
+{
+    homographyChainer(const vector<detail::MatchesInfo> & matches, vector<Mat> & toReference, vector<int> & order)
+        : matches(matches), toReference(toReference), order(order) {}
+
+    void operator()(const detail::GraphEdge & edge)
+    {
+        // the matches for (to, from) hold the homography from the new camera to the one already placed
+        Mat H;
+        this->matches[edge.to * this->toReference.size() + edge.from].H.convertTo(H, CV_64F);
+        this->toReference[edge.to] = this->toReference[edge.from] * H;
+        this->order.push_back(edge.to);
+    }
+
+    const vector<detail::MatchesInfo> & matches;
+    vector<Mat> & toReference;
+    vector<int> & order;
+};
+
+QString stitchThread::stageName(int stage)
+{
+    switch (stage) {
+    case ESTIMATE:
+        return "estimating cameras";
+    case BUNDLE_ADJUST:
+        return "bundle adjustment";
+    case WAVE_CORRECT:
+        return "wave correction";
+    case WARP:
+        return "warp geometry";
+    case EXPOSURE:
+        return "exposure compensation";
+    case BLEND:
+        return "warping and blending";
+    default:
+        return "";
+    }
+}
+
+bool stitchThread::startStage(int stage)
+{
+    // end the timing of the previous stage
+    this->stageTimer.reset();
+
+    if (this->cancelRequested.load()) {
+        this->cancelled = true;
+        return false;
+    }
+
+    // the planar engine has no bundle adjustment or wave correction, so count only the stages it runs
+    int position = stage;
+    int stageCount = STAGE_COUNT;
+    if (this->engine == PLANAR) {
+        stageCount -= 2;
+        if (stage > WAVE_CORRECT) {
+            position -= 2;
+        }
+    }
+    emit progress(position, stageCount, stageName(stage));
+    this->stageTimer.reset(new ScopedStageTimer(stageName(stage), "stitch"));
+    return true;
+}
+
+void stitchThread::run()
+{
+    // clear the previous output, so a cancelled or failed run leaves nothing behind
+    this->finalImage = Mat();
+    this->cancelled = false;
+    this->adjusterIterations = 0;
+    this->adjusterConverged = false;
+
+    const vector<Mat> & cameraCalibrationImages = *this->session->images;
+
+    // the plane projection and the resize to the stitched image are both homographies, so rather than warping to
+    // the plane at full scale and then resizing, each camera is warped straight to the stitched image
+    ArenaGeometry geometry;
+    bool estimated = this->engine == PLANAR ? this->estimatePlanar(geometry) : this->estimateRotating(geometry);
+    if (!estimated) {
+        this->stageTimer.reset();
+        return;
+    }
+
+    // the stitched image is only for finding the arena corners, so it is sized by megapixels with the shape of the
+    // panorama rather than stretched to a fixed size
+    double stitchedScale = sqrt(this->stitchedMegapix * 1e6 / double(geometry.panoramaRoi.area()));
+    geometry.stitchedSize = Size(max(1, cvRound(geometry.panoramaRoi.width * stitchedScale)),
+                                 max(1, cvRound(geometry.panoramaRoi.height * stitchedScale)));
+
+    vector<Mat> homographies(cameraCalibrationImages.size());
+    for (uint i = 0; i < homographies.size(); ++i) {
+        homographies[i] = geometry.cameraToStitched(i);
+    }
+
+    // calculate to compensate for exposure, on low resolution warps as the gains don't depend on resolution
+    if (!startStage(EXPOSURE)) return;
+
+    this->gains = estimateGains(cameraCalibrationImages, homographies, geometry.stitchedSize, this->exposureMegapix);
+
+    // apply compensation and feather the images together at the compose resolution
+    if (!startStage(BLEND)) return;
+
+    vector<Mat> composeImages(cameraCalibrationImages.size());
+    for (uint i = 0; i < composeImages.size(); ++i) {
+        composeImages[i] = cameraCalibrationImages[i];
+        if (this->composeScale < 1.0) {
+            cv::resize(cameraCalibrationImages[i], composeImages[i], Size(), this->composeScale, this->composeScale, INTER_AREA);
+        }
+    }
+
+    // the blend is the longest stage, so it also stops between cameras when cancelled
+    Mat result = composeCameras(composeImages, homographies, this->gains, geometry.stitchedSize, this->composeScale,
+                                &this->cancelRequested);
+    this->stageTimer.reset();
+    if (this->cancelRequested.load()) {
+        this->cancelled = true;
+        return;
+    }
+
+    // send back the necessary transformation Matrices
+    this->Ks = geometry.Ks;
+    this->Rs = geometry.Rs;
+    this->planarHs = geometry.planarHs;
+    this->panoramaRoi = geometry.panoramaRoi;
+
+    // only set once everything else is in place, as a valid final image marks a successful stitch
+    this->finalImage = result;
+}
+
+bool stitchThread::estimateRotating(ArenaGeometry & geometry)
+{
+    const vector<Mat> & cameraCalibrationImages = *this->session->images;
+    const vector<detail::ImageFeatures> & features = *this->session->features;
+    const vector<detail::MatchesInfo> & pairwise_matches = *this->session->matches;
+
+    // Camera estimation
+    if (!startStage(ESTIMATE)) return false;
+
+    vector<detail::CameraParams> cameras;
+    if (this->initialKs.size() == features.size() && this->initialRs.size() == features.size()) {
+
+        // start from the previous calibration, scaling its full resolution intrinsics to the features
+        cameras.resize(features.size());
+        for (size_t i = 0; i < cameras.size(); ++i) {
+            Mat_<double> K;
+            this->initialKs[i].convertTo(K, CV_64F);
+            cameras[i].focal = K(0,0) * this->session->featureScale;
+            cameras[i].aspect = K(1,1) / K(0,0);
+            cameras[i].ppx = K(0,2) * this->session->featureScale;
+            cameras[i].ppy = K(1,2) * this->session->featureScale;
+            this->initialRs[i].convertTo(cameras[i].R, CV_32F);
+        }
+        this->stageTimer->addArg("warm start", 1);
+
+    } else {
+
+        detail::HomographyBasedEstimator estimator;
+        estimator(features, pairwise_matches, cameras);
+
+        for (size_t i = 0; i < cameras.size(); ++i)
+         {
+             Mat R;
+             cameras[i].R.convertTo(R, CV_32F);
+             cameras[i].R = R;
+         }
+    }
+
+    // Refine projection
+    if (!startStage(BUNDLE_ADJUST)) return false;
+
+    Ptr<detail::BundleAdjusterBase> adjuster;
+    adjuster = makePtr<detail::BundleAdjusterReproj>();
+    adjuster->setConfThresh(0.6f);
+    Mat_<uchar> refine_mask = Mat::zeros(3, 3, CV_8U);
+    refine_mask(0,0) = 1;
+    refine_mask(0,1) = 1;
+    refine_mask(0,2) = 1;
+    refine_mask(1,1) = 1;
+    refine_mask(1,2) = 1;
+    adjuster->setRefinementMask(refine_mask);
+
+    // the adjuster can take a very long time to converge on poor matches, so it is run a chunk at a time, each
+    // continuing from the last, until the cameras settle or the budget runs out
+    QElapsedTimer adjusterClock;
+    adjusterClock.start();
+    this->adjusterIterations = 0;
+    this->adjusterConverged = false;
+    while (this->adjusterIterations < this->adjusterMaxIterations) {
+        int chunk = min(adjusterChunk, this->adjusterMaxIterations - this->adjusterIterations);
+        adjuster->setTermCriteria(TermCriteria(TermCriteria::COUNT + TermCriteria::EPS, chunk, DBL_EPSILON));
+
+        vector<detail::CameraParams> previous = cameras;
+        if (!(*adjuster)(features, pairwise_matches, cameras)) {
+            cameras = previous;
+            break;
+        }
+        this->adjusterIterations += chunk;
+
+        if (camerasSettled(previous, cameras)) {
+            this->adjusterConverged = true;
+            break;
+        }
+        if (this->cancelRequested.load()) {
+            this->stageTimer.reset();
+            this->cancelled = true;
+            return false;
+        }
+        if (this->adjusterMaxSeconds > 0.0 && adjusterClock.elapsed() > this->adjusterMaxSeconds * 1000.0) {
+            break;
+        }
+    }
+    this->stageTimer->addArg("iterations", this->adjusterIterations);
+    this->stageTimer->addArg("converged", this->adjusterConverged ? 1 : 0);
+
+    if (!startStage(WAVE_CORRECT)) return false;
+
+    // Find median focal length
+    vector<double> focals;
+    for (size_t i = 0; i < cameras.size(); ++i)
+    {
+        focals.push_back(cameras[i].focal);
+    }
+
+    sort(focals.begin(), focals.end());
+    float warped_image_scale;
+    if (focals.size() % 2 == 1)
+        warped_image_scale = static_cast<float>(focals[focals.size() / 2]);
+    else
+        warped_image_scale = static_cast<float>(focals[focals.size() / 2 - 1] + focals[focals.size() / 2]) * 0.5f;
+
+    vector<Mat> rmats;
+    for (size_t i = 0; i < cameras.size(); ++i)
+        rmats.push_back(cameras[i].R.clone());
+    detail::waveCorrect(rmats, detail::WAVE_CORRECT_HORIZ);
+    for (size_t i = 0; i < cameras.size(); ++i)
+        cameras[i].R = rmats[i];
+
+    // the cameras were estimated from the work resolution features, so scale them up to the full resolution images
+    for (size_t i = 0; i < cameras.size(); ++i)
+    {
+        cameras[i].focal /= this->session->featureScale;
+        cameras[i].ppx /= this->session->featureScale;
+        cameras[i].ppy /= this->session->featureScale;
+    }
+
+    if (!startStage(WARP)) return false;
+
+    Ptr<WarperCreator> warper_creator;
+    warper_creator = makePtr<cv::PlaneWarper>();
+    Ptr<detail::RotationWarper> warper = warper_creator->create(this->warpScale);
+
+    // find the region of the plane covered by the panorama
+    vector<Point> corners(cameraCalibrationImages.size());
+    vector<Size> sizes(cameraCalibrationImages.size());
+    for (int i = 0; i < cameraCalibrationImages.size(); ++i) {
+        Mat_<float> K;
+        cameras[i].K().convertTo(K, CV_32F);
+        Rect roi = warper->warpRoi(cameraCalibrationImages[i].size(), K, cameras[i].R);
+        corners[i] = roi.tl();
+        sizes[i] = roi.size();
+    }
+    geometry.warpScale = this->warpScale;
+    geometry.panoramaRoi = detail::resultRoi(corners, sizes);
+    for (uint i = 0; i < cameras.size(); ++i) {
+        geometry.Ks.push_back(cameras[i].K());
+        geometry.Rs.push_back(cameras[i].R);
+    }
+
+    return true;
+}
+
+bool stitchThread::estimatePlanar(ArenaGeometry & geometry)
+{
+    const vector<Mat> & cameraCalibrationImages = *this->session->images;
+    const vector<detail::ImageFeatures> & features = *this->session->features;
+    const vector<detail::MatchesInfo> & pairwise_matches = *this->session->matches;
+    int cameraCount = int(features.size());
+
+    if (!startStage(ESTIMATE)) return false;
+
+    // chain the pairwise RANSAC homographies out from the best connected camera along the most confident matches,
+    // putting every camera in the frame of that reference camera
+    detail::Graph spanTree;
+    vector<int> centres;
+    detail::findMaxSpanningTree(cameraCount, pairwise_matches, spanTree, centres);
+    if (centres.empty()) {
+        return false;
+    }
+
+    vector<Mat> toReference(cameraCount);
+    vector<int> order(1, centres[0]);
+    toReference[centres[0]] = Mat::eye(3, 3, CV_64F);
+    spanTree.walkBreadthFirst(centres[0], homographyChainer(pairwise_matches, toReference, order));
+
+    if (int(order.size()) != cameraCount) {
+        return false;
+    }
+
+    // errors build up along the chain, so refit each camera to the inliers of all its neighbours already placed,
+    // not just the one it was chained from
+    for (uint k = 1; k < order.size(); ++k) {
+        int camera = order[k];
+        vector<Point2f> cameraPoints, referencePoints;
+        for (uint m = 0; m < k; ++m) {
+            int placed = order[m];
+            const detail::MatchesInfo & info = pairwise_matches[camera * cameraCount + placed];
+            if (info.H.empty()) {
+                continue;
+            }
+            vector<Point2f> placedPoints;
+            for (uint j = 0; j < info.matches.size(); ++j) {
+                if (info.inliers_mask[j]) {
+                    cameraPoints.push_back(features[camera].keypoints[info.matches[j].queryIdx].pt);
+                    placedPoints.push_back(features[placed].keypoints[info.matches[j].trainIdx].pt);
+                }
+            }
+            if (!placedPoints.empty()) {
+                perspectiveTransform(placedPoints, placedPoints, toReference[placed]);
+                referencePoints.insert(referencePoints.end(), placedPoints.begin(), placedPoints.end());
+            }
+        }
+        if (cameraPoints.size() >= 4) {
+            Mat H = findHomography(cameraPoints, referencePoints, 0);
+            if (!H.empty()) {
+                toReference[camera] = H;
+            }
+        }
+    }
+    this->stageTimer->addArg("reference camera", centres[0]);
+
+    if (!startStage(WARP)) return false;
+
+    // the homographies were found between the work resolution features, so take them to full resolution pixels
+    Mat toWork = scaleMatrix(this->session->featureScale);
+    Mat fromWork = toWork.inv();
+
+    // the panorama covers the floor seen by all the cameras, in full resolution reference camera pixels
+    vector<Point2f> extent;
+    for (int i = 0; i < cameraCount; ++i) {
+        Mat H = fromWork * toReference[i] * toWork;
+        geometry.planarHs.push_back(H / H.at<double>(2,2));
+
+        Size imageSize = cameraCalibrationImages[i].size();
+        vector<Point2f> imageCorners;
+        imageCorners.push_back(Point2f(0, 0));
+        imageCorners.push_back(Point2f(imageSize.width, 0));
+        imageCorners.push_back(Point2f(0, imageSize.height));
+        imageCorners.push_back(Point2f(imageSize.width, imageSize.height));
+        perspectiveTransform(imageCorners, imageCorners, geometry.planarHs[i]);
+        extent.insert(extent.end(), imageCorners.begin(), imageCorners.end());
+    }
+    geometry.panoramaRoi = boundingRect(extent);
+
+    // a homography taking a camera past the horizon gives a huge or degenerate panorama, so fail rather than try to
+    // compose it
+    double cameraArea = double(cameraCalibrationImages[0].size().area());
+    if (geometry.panoramaRoi.area() <= 0 || double(geometry.panoramaRoi.area()) > 100.0 * cameraCount * cameraArea) {
+        return false;
+    }
+
+    return true;
+}
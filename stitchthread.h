@@ -0,0 +1,176 @@
+#ifndef STITCHTHREAD_H
+#define STITCHTHREAD_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+#include <opencv2/stitching.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+// Qt base include
+#include <QThread>
+#include <QAtomicInt>
+#include <QString>
+#include <QScopedPointer>
+
+// Project includes
+#include "stagetimer.h"
+#include "calibrationsession.h"
+#include "arenawarp.h"
+
+/*!
+ * \brief The stitchThread class
+ * As the stitching can hang, we run it in a seperate thread. The stitch is split into stages, with a progress signal
+ * as each starts and a check for cancellation between them, so an abort leaves the thread cleanly after the current
+ * stage rather than being terminated part way through an OpenCV call.
+ */
+class stitchThread : public QThread
+{
+    Q_OBJECT
+public:
+    /*!
+     * \brief The stage enum
+     * The stages of the stitch, in order
+     */
+    enum stage {
+        ESTIMATE,
+        BUNDLE_ADJUST,
+        WAVE_CORRECT,
+        WARP,
+        EXPOSURE,
+        BLEND,
+        STAGE_COUNT
+    };
+
+    /*!
+     * \brief The engineType enum
+     * How the cameras are placed in the stitched image. ROTATION models the cameras as rotating about a common
+     * centre, refined by bundle adjustment and projected onto a plane. PLANAR maps each camera straight onto the floor
+     * plane with homographies chained from the pairwise matches, which is faster and deterministic.
+     */
+    enum engineType {
+        ROTATION,
+        PLANAR
+    };
+
+    /*!
+     * \brief stageName
+     * Human readable name for a stage
+     */
+    static QString stageName(int stage);
+
+    // the data we need to run the stitcher, shared with the calibration rather than copied
+    calibrationSessionPtr session;
+
+    // the engine to place the cameras with
+    int engine = ROTATION;
+
+    // the scale of the images to warp into the output
+    double composeScale = 1.0;
+
+    /*!
+     * \brief stitchedMegapix
+     * The size of the stitched image in megapixels, it keeps the shape of the panorama
+     */
+    double stitchedMegapix = 2.4;
+
+    /*!
+     * \brief exposureMegapix
+     * The size of the output in megapixels used to estimate the exposure gains, set by CalibrateArena
+     */
+    double exposureMegapix = 0.1;
+
+    /*!
+     * \brief adjusterMaxIterations, adjusterMaxSeconds
+     * The budget for bundle adjustment, which stops at whichever is reached first (a time <= 0 for no limit)
+     */
+    int adjusterMaxIterations = 200;
+    double adjusterMaxSeconds = 30.0;
+
+    /*!
+     * \brief initialKs, initialRs
+     * Cameras from a previous calibration of the same rig to start bundle adjustment from, in place of estimating
+     * them from the matches. The intrinsics are at full camera resolution. Empty to estimate the cameras.
+     */
+    vector < Mat > initialKs;
+    vector < Mat > initialRs;
+
+    // the stitcher output
+    Mat finalImage;
+
+    // reprojection details to save...
+    vector < Mat > Ks;
+    vector < Mat > Rs;
+    vector < Mat > planarHs;
+    float warpScale = 3000.0f;
+    Rect panoramaRoi;
+    vector < double > gains;
+
+    // how the bundle adjustment went, the planar engine has none
+    int adjusterIterations = 0;
+    bool adjusterConverged = false;
+
+    /*!
+     * \brief requestCancel
+     * Ask the stitcher to stop at the end of the current stage
+     */
+    void requestCancel() { this->cancelRequested.store(1); }
+
+    /*!
+     * \brief clearCancel
+     * Clear any earlier cancel request, call before start() so a request made while the thread starts is kept
+     */
+    void clearCancel() { this->cancelRequested.store(0); }
+
+    /*!
+     * \brief wasCancelled
+     * True if the last run stopped early due to a cancel request
+     */
+    bool wasCancelled() { return this->cancelled; }
+
+signals:
+    /*!
+     * \brief progress
+     * Emitted as each stage of the stitch starts, with its position among the stages the engine in use runs
+     */
+    void progress(int stage, int stageCount, QString name);
+
+private:
+    /*!
+     * \brief run
+     * The execution method for the thread, performing the stitching process
+     */
+    void run();
+
+    /*!
+     * \brief startStage
+     * Report the start of a stage, returning false if the stitch has been cancelled
+     */
+    bool startStage(int stage);
+
+    /*!
+     * \brief estimateRotating
+     * Place the cameras with the rotating camera model, returns false if cancelled or the estimate failed
+     */
+    bool estimateRotating(ArenaGeometry & geometry);
+
+    /*!
+     * \brief estimatePlanar
+     * Place the cameras on the floor plane with homographies, returns false if cancelled or the estimate failed
+     */
+    bool estimatePlanar(ArenaGeometry & geometry);
+
+    QAtomicInt cancelRequested;
+    bool cancelled = false;
+
+    /*!
+     * \brief stageTimer
+     * Times the current stage, replaced as each stage starts
+     */
+    QScopedPointer < ScopedStageTimer > stageTimer;
+};
+
+#endif // STITCHTHREAD_H
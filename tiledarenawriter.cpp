@@ -0,0 +1,254 @@
+#include "tiledarenawriter.h"
+
+// OpenCV includes
+#include <opencv2/imgproc.hpp>
+#include <opencv2/imgcodecs.hpp>
+
+// Qt includes
+#include <QAtomicInt>
+#include <QFile>
+#include <QFileInfo>
+#include <QMutex>
+#include <QMutexLocker>
+#include <QStringList>
+#include <QVector>
+#include <QtConcurrent>
+
+// Project includes
+#include "arenawarp.h"
+#include "stagetimer.h"
+
+/*!
+ * \brief borderDistance
+ * The distance of each pixel to the image border, the feather weight of the camera pixels
+ */
+static Mat borderDistance(Size size)
+{
+    Mat border(size, CV_32F);
+    for (int y = 0; y < border.rows; ++y) {
+        float * row = border.ptr<float>(y);
+        for (int x = 0; x < border.cols; ++x) {
+            row[x] = float(min(min(x + 1, border.cols - x), min(y + 1, border.rows - y)));
+        }
+    }
+    return border;
+}
+
+/*!
+ * \brief The tiledArena struct
+ * Everything the tile workers share, read only apart from the output file and failure flag
+ */
+struct tiledArena
+{
+    vector < Mat > images;
+    vector < Mat > borders;
+    vector < Mat > toOutput;
+    vector < Rect > rois;
+    vector < double > gains;
+
+    Size outputSize;
+    int tileSize;
+    QString fileName;
+
+    // the streamed output, tiles take turns to write their rows into place
+    QFile * stream = NULL;
+    QMutex streamLock;
+    qint64 headerSize = 0;
+
+    QAtomicInt failed;
+
+    // shared with the writer, for progress and cancelling from other threads
+    QAtomicInt * cancelled = NULL;
+    QAtomicInt * tilesDone = NULL;
+};
+
+/*!
+ * \brief canWriteTiles
+ * True if OpenCV has a writer for the tile image extension, imwrite throws on anything else
+ */
+static bool canWriteTiles(QString suffix)
+{
+    static const QStringList formats = QStringList() << "bmp" << "dib" << "jpeg" << "jpg" << "jpe" << "jp2" << "png"
+                                                     << "webp" << "pbm" << "pgm" << "pnm" << "sr" << "ras" << "tiff"
+                                                     << "tif" << "exr";
+    return formats.contains(suffix.toLower());
+}
+
+/*!
+ * \brief The tileComposer struct
+ * Composes one tile of the output and writes it, run concurrently across the tiles
+ */
+struct tileComposer
+{
+    typedef void result_type;
+
+    tileComposer(tiledArena * arena) : arena(arena) {}
+
+    void operator()(const Rect & tile) const
+    {
+        if (this->arena->failed.load() || this->arena->cancelled->load()) {
+            return;
+        }
+
+        // a codec missing from this OpenCV build still throws, which would otherwise escape the map
+        try {
+            this->compose(tile);
+        } catch (cv::Exception &) {
+            this->arena->failed.store(1);
+        }
+        this->arena->tilesDone->ref();
+    }
+
+    void compose(const Rect & tile) const
+    {
+        ScopedStageTimer timer("compose tile", "tiles");
+        timer.addArg("x", tile.x);
+        timer.addArg("y", tile.y);
+
+        Mat sum = Mat::zeros(tile.size(), CV_32FC3);
+        Mat weightSum = Mat::zeros(tile.size(), CV_32F);
+
+        for (uint i = 0; i < this->arena->images.size(); ++i) {
+            Rect region = this->arena->rois[i] & tile;
+            if (region.area() == 0) {
+                continue;
+            }
+
+            // warp just the part of the camera covering this tile
+            Mat_<double> shift = Mat::eye(3, 3, CV_64F);
+            shift(0,2) = -region.x;
+            shift(1,2) = -region.y;
+            Mat H = shift * this->arena->toOutput[i];
+
+            Mat warped, weight;
+            warpPerspective(this->arena->images[i], warped, H, region.size(), INTER_LINEAR, BORDER_REFLECT);
+            warpPerspective(this->arena->borders[i], weight, H, region.size(), INTER_LINEAR, BORDER_CONSTANT, Scalar(0));
+
+            Mat weighted;
+            warped.convertTo(weighted, CV_32FC3, i < this->arena->gains.size() ? this->arena->gains[i] : 1.0);
+            Mat weight3;
+            Mat channels[3] = {weight, weight, weight};
+            merge(channels, 3, weight3);
+
+            Rect inTile = region - tile.tl();
+            Mat sumRegion = sum(inTile);
+            sumRegion += weighted.mul(weight3);
+            Mat weightRegion = weightSum(inTile);
+            weightRegion += weight;
+        }
+
+        // pixels no camera sees have no weight, and come out black
+        Mat weightSum3, result;
+        Mat channels[3] = {weightSum, weightSum, weightSum};
+        merge(channels, 3, weightSum3);
+        divide(sum, weightSum3, sum);
+        sum.convertTo(result, CV_8UC3);
+
+        if (this->arena->stream) {
+            // PPM is RGB, row by row across the whole output
+            cvtColor(result, result, COLOR_BGR2RGB);
+            QMutexLocker locker(&this->arena->streamLock);
+            for (int y = 0; y < result.rows; ++y) {
+                qint64 offset = this->arena->headerSize + (qint64(tile.y + y) * this->arena->outputSize.width + tile.x) * 3;
+                qint64 bytes = qint64(result.cols) * 3;
+                if (!this->arena->stream->seek(offset) || this->arena->stream->write((const char *) result.ptr(y), bytes) != bytes) {
+                    this->arena->failed.store(1);
+                    return;
+                }
+            }
+        } else {
+            QFileInfo output(this->arena->fileName);
+            QString tileName = QString("%1/%2_%3_%4.%5").arg(output.absolutePath()).arg(output.completeBaseName())
+                    .arg(tile.y / this->arena->tileSize).arg(tile.x / this->arena->tileSize).arg(output.suffix());
+            if (!imwrite(tileName.toStdString(), result)) {
+                this->arena->failed.store(1);
+            }
+        }
+    }
+
+    tiledArena * arena;
+};
+
+TiledArenaWriter::TiledArenaWriter()
+{
+}
+
+bool TiledArenaWriter::write(const vector < Mat > & images, const vector < Mat > & homographies, const vector < double > & gains,
+                             Size outputSize, QString fileName, double imageScale)
+{
+    if (images.empty() || images.size() != homographies.size() || outputSize.area() <= 0 || this->tileSize < 16) {
+        this->error = "Nothing to compose";
+        return false;
+    }
+
+    QString suffix = QFileInfo(fileName).suffix().toLower();
+    if (suffix != "ppm" && !canWriteTiles(suffix)) {
+        this->error = "Give the arena image a .ppm or image extension (such as .png) to write it";
+        return false;
+    }
+
+    ScopedStageTimer timer("tiled arena", "tiles");
+    timer.addArg("width", outputSize.width);
+    timer.addArg("height", outputSize.height);
+
+    tiledArena arena;
+    arena.outputSize = outputSize;
+    arena.tileSize = this->tileSize;
+    arena.fileName = fileName;
+    arena.gains = gains;
+    arena.cancelled = &this->cancelRequested;
+    arena.tilesDone = &this->tilesDone;
+
+    // the border weights are only built once for each image size
+    Mat fromImage = scaleMatrix(1.0 / imageScale);
+    for (uint i = 0; i < images.size(); ++i) {
+        arena.images.push_back(images[i]);
+        if (i > 0 && images[i].size() == images[i - 1].size()) {
+            arena.borders.push_back(arena.borders.back());
+        } else {
+            arena.borders.push_back(borderDistance(images[i].size()));
+        }
+        arena.toOutput.push_back(homographies[i] * fromImage);
+        arena.rois.push_back(warpedRoi(images[i].size(), arena.toOutput.back(), outputSize));
+    }
+
+    QFile stream(fileName);
+    if (suffix == "ppm") {
+        if (!stream.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+            this->error = "Could not open " + fileName + " for writing";
+            return false;
+        }
+        QByteArray header = QString("P6\n%1 %2\n255\n").arg(outputSize.width).arg(outputSize.height).toLatin1();
+        arena.headerSize = header.size();
+        if (stream.write(header) != arena.headerSize || !stream.resize(arena.headerSize + qint64(outputSize.area()) * 3)) {
+            this->error = "Could not write " + fileName;
+            return false;
+        }
+        arena.stream = &stream;
+    }
+
+    QVector < Rect > tiles;
+    for (int y = 0; y < outputSize.height; y += this->tileSize) {
+        for (int x = 0; x < outputSize.width; x += this->tileSize) {
+            tiles.push_back(Rect(x, y, this->tileSize, this->tileSize) & Rect(Point(0,0), outputSize));
+        }
+    }
+    timer.addArg("tiles", tiles.size());
+    this->tilesDone.store(0);
+    this->tileTotal.store(tiles.size());
+
+    QtConcurrent::blockingMap(tiles, tileComposer(&arena));
+
+    if (arena.stream && !stream.flush()) {
+        arena.failed.store(1);
+    }
+    if (this->cancelRequested.load()) {
+        this->error = "Arena image cancelled, " + fileName + " is incomplete";
+        return false;
+    }
+    if (arena.failed.load()) {
+        this->error = "Could not write the arena image to " + fileName;
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,89 @@
+#ifndef TILEDARENAWRITER_H
+#define TILEDARENAWRITER_H
+#include <vector>
+
+// OpenCV includes
+#include <opencv2/core/core.hpp>
+
+// allow easy addressing of OpenCV functions
+using namespace cv;
+using namespace std;
+
+// Qt base include
+#include <QAtomicInt>
+#include <QString>
+
+/*!
+ * \brief The TiledArenaWriter class
+ *
+ * Composes the squared arena from the camera images straight to disk one tile at a time, so the output can be far
+ * larger than would fit in memory as a single image. The tiles are composed concurrently, and each is written as soon
+ * as it is done, so at most one tile per worker thread is held at once.
+ *
+ * Each camera is weighted by its distance to the camera image border, warped with the same homography as the
+ * image, as the live compositor does. The weight of an output pixel does not depend on which tile it is in, so the
+ * tiles join without seams. This differs from the squared image shown in the user interface, which is blended with
+ * OpenCV's FeatherBlender (a ramp from the edge of each warped camera, computed over the whole image). The geometry
+ * and exposure gains are the same, only the blend across the overlaps differs, matching the live compositor
+ * rather than the preview.
+ *
+ * A .ppm file name gives a single binary PPM streamed to disk, with each tile written into place. Any other name
+ * gives one image per tile, named <name>_<tile row>_<tile column> with the same extension, which must be an image
+ * format OpenCV writes.
+ *
+ * The progress and cancel request may be used from other threads while a write runs.
+ */
+class TiledArenaWriter
+{
+public:
+    TiledArenaWriter();
+
+    /*!
+     * \brief setTileSize
+     * The width and height of the tiles, defaults to 1024
+     */
+    void setTileSize(int size) { this->tileSize = size; }
+
+    /*!
+     * \brief write
+     * Compose the cameras into an output of the given size and write it. H maps raw camera pixels to output pixels,
+     * imageScale gives the scale of the images if they have been resized from the raw camera size. Returns true on
+     * success.
+     */
+    bool write(const vector < Mat > & images, const vector < Mat > & homographies, const vector < double > & gains,
+               Size outputSize, QString fileName, double imageScale = 1.0);
+
+    QString lastError() { return this->error; }
+
+    /*!
+     * \brief reset
+     * Clear the progress and any cancel request, call before starting a write that may be cancelled
+     */
+    void reset() { this->cancelRequested.store(0); this->tilesDone.store(0); this->tileTotal.store(0); }
+
+    /*!
+     * \brief requestCancel
+     * Stop the write before the next tile, the write then fails
+     */
+    void requestCancel() { this->cancelRequested.store(1); }
+
+    bool wasCancelled() { return this->cancelRequested.load() != 0; }
+
+    /*!
+     * \brief tilesWritten, tileCount
+     * The progress of the current write
+     */
+    int tilesWritten() { return this->tilesDone.load(); }
+    int tileCount() { return this->tileTotal.load(); }
+
+private:
+    int tileSize = 1024;
+
+    QAtomicInt cancelRequested;
+    QAtomicInt tilesDone;
+    QAtomicInt tileTotal;
+
+    QString error;
+};
+
+#endif // TILEDARENAWRITER_H